@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <chrono>
+#include <string>
+
+#include "lexer.h"
+#include "parser.h"
+
+using namespace almond;
+
+// Number-dense input in the style of emscripten data tables and asm.js code
+static std::string makeNumberInput(size_t size) {
+  static const char* chunk =
+    "[0, 1, 255, 65535, 0x7fffffff, 0xFF, 017, 3.5, .25, 1e10, 1.5e-7,\n"
+    " 4294967295, 2147483648, 0.30000000000000004, 6.02214076e23, 1e-300,\n"
+    " 123456789012345678901, 9007199254740993, 42, 7, 1000000, 0.1];\n";
+  std::string src;
+  while (src.size() < size) src += chunk;
+  return src;
+}
+
+// Integer-only input, like HEAP initializers
+static std::string makeIntInput(size_t size) {
+  std::string src;
+  unsigned x = 12345;
+  while (src.size() < size) {
+    x = x * 1103515245 + 12345;
+    src += std::to_string(x % 100000);
+    src += (x & 0x100) ? ",\n" : ",";
+  }
+  return src;
+}
+
+// Punctuation-heavy asm.js style code
+static std::string makeAsmInput(size_t size) {
+  static const char* chunk =
+    " i1 = i2 + 8 | 0; HEAP32[i1 >> 2] = (HEAP32[i3 >> 2] | 0) + -1 | 0;\n"
+    " if ((i4 | 0) != 0 & (i5 >>> 0) <= 255) { i6 = ~~+HEAPF64[i7 >> 3]; }\n"
+    " while (!(i8 === i9) && i10 >= 0) { i10 = i10 - 1 | 0; i11 <<= 1; }\n";
+  std::string src;
+  while (src.size() < size) src += chunk;
+  return src;
+}
+
+// Pretty-printed code with license headers, comments and deep indentation
+static std::string makeSpaceInput(size_t size) {
+  static const char* header =
+    "/*\n"
+    " * Copyright (c) 2013 The Emscripten Authors. All rights reserved.\n"
+    " * Permission is hereby granted, free of charge, to any person obtaining\n"
+    " * a copy of this software and associated documentation files.\n"
+    " */\n";
+  static const char* body =
+    "                if (x) {\n"
+    "                    // keep the loop tight, see the comment above\n"
+    "                    y = x;\n"
+    "                }\n"
+    "\n";
+  std::string src;
+  while (src.size() < size) {
+    src += header;
+    for (int i = 0; i < 8; ++i) src += body;
+  }
+  return src;
+}
+
+// Identifier-heavy library style code
+static std::string makeIdentInput(size_t size) {
+  static const char* chunk =
+    "function updateElementStyles(element, computedStyle, options) {\n"
+    "  var currentValue = element.getAttribute(options.attributeName);\n"
+    "  if (currentValue !== computedStyle.previousValue && options.enabled)\n"
+    "    return callbackRegistry.dispatchEvent(element, currentValue);\n"
+    "  return undefined;\n"
+    "}\n";
+  std::string src;
+  while (src.size() < size) src += chunk;
+  return src;
+}
+
+// One large base64 memory initializer string, with a few escapes
+static std::string makeStringInput(size_t size) {
+  static const char* b64 =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string src = "var memInit = \"";
+  unsigned x = 12345;
+  while (src.size() < size) {
+    x = x * 1103515245 + 12345;
+    src += b64[(x >> 16) & 63];
+    if ((x & 0xFFFF) == 0) src += "\\n";
+  }
+  src += "\";\n";
+  return src;
+}
+
+// Generated code with one deeply nested statement: an if/else if ladder
+// about half a million levels deep, with nested ternaries in each condition
+static std::string makeNestedInput(size_t size) {
+  static const char* chunk = "if (a ? b : c ? d : e) f(); else ";
+  std::string src;
+  while (src.size() < size) src += chunk;
+  src += "g();\n";
+  return src;
+}
+
+// Builder which discards the nodes, to time the parser alone. It takes
+// operators and names without copying them (Builder API version 2).
+struct NullNode {};
+
+struct NullBuilder {
+  static const int BUILDER_VERSION = 2;
+  static NullNode* makeToplevel() { return nullptr; }
+  static void appendStatement(NullNode*, NullNode*) {}
+  static NullNode* makeEmpty() { return nullptr; }
+  static NullNode* makeCall(NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeList() { return nullptr; }
+  static int getSize(NullNode*) { return 0; }
+  static NullNode* makeIf(NullNode*, NullNode*, NullNode*) { return nullptr; }
+  static void append(NullNode*, NullNode*) {}
+  static NullNode* makeUndefined() { return nullptr; }
+  static NullNode* makeNull() { return nullptr; }
+  static NullNode* makeWhile(NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeDo(NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeFor(NullNode*, NullNode*, NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeForIn(bool, NullNode*, NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeSwitch(NullNode*) { return nullptr; }
+  static NullNode* appendSwitchCase(NullNode*, NullNode*) { return nullptr; }
+  static NullNode* appendSwitchStatement(NullNode*, NullNode*) { return nullptr; }
+  static NullNode* appendSwitchDefault(NullNode*) { return nullptr; }
+  static bool isBinary(NullNode*, OpId) { return false; }
+  static bool isName(NullNode*) { return true; }
+  static NullNode* makeBreak(std::string_view) { return nullptr; }
+  static NullNode* makeContinue(std::string_view) { return nullptr; }
+  static NullNode* makeReturn(NullNode*) { return nullptr; }
+  static NullNode* makeThrow(NullNode*) { return nullptr; }
+  static NullNode* makeTry(NullNode*, NullNode*, NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeVars() { return nullptr; }
+  static void appendVar(NullNode*, std::string_view, NullNode*) {}
+  static NullNode* makeLabel(std::string_view, NullNode*) { return nullptr; }
+  static NullNode* makeSub(NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeIndex(NullNode*, std::string_view) { return nullptr; }
+  static NullNode* makeConditional(NullNode*, NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeBinary(OpId, NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeUnary(OpId, NullNode*) { return nullptr; }
+  static NullNode* makeArray(NullNode*) { return nullptr; }
+  static NullNode* makeNew(NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeFunction(std::string_view, NullNode*, NullNode*) { return nullptr; }
+  static NullNode* makeName(std::string_view) { return nullptr; }
+  static NullNode* makeNum(double) { return nullptr; }
+  static NullNode* makeString(StringLiteral) { return nullptr; }
+  static NullNode* makeBool(bool) { return nullptr; }
+};
+
+// Parses per second of a small file with a syntax error, as when
+// validating a corpus where many files fail
+static double failedParsesPerSec(const char* src, size_t count) {
+  PaddedBuffer buf(src, strlen(src));
+  Parser<NullNode, NullBuilder> parser;
+  size_t failures = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    parser.parseString(buf.str(), buf.len, "bench.js");
+    failures += parser.failed();
+  }
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  if (failures != count) printf("unexpected successful parse\n");
+  return count / secs.count();
+}
+
+// Full parse of expression-heavy code, building no nodes
+static double parseMBps(std::string& src) {
+  PaddedBuffer buf(src.data(), src.size());
+  Parser<NullNode, NullBuilder> parser;
+  auto start = std::chrono::steady_clock::now();
+  parser.parseString(buf.str(), buf.len, "bench.js");
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  if (parser.failed()) printf("%s\n", parser.error.toString().c_str());
+  return src.size() / (1024.0 * 1024.0) / secs.count();
+}
+
+// Incremental parse of input arriving in small chunks
+static double chunkedMBps(std::string& src, size_t chunkSize) {
+  IncrementalParser<NullNode, NullBuilder> parser("bench.js");
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < src.size(); i += chunkSize)
+    parser.feed(src.data() + i, std::min(chunkSize, src.size() - i));
+  parser.finish();
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  if (parser.parser.failed()) printf("%s\n", parser.parser.error.toString().c_str());
+  return src.size() / (1024.0 * 1024.0) / secs.count();
+}
+
+static double lexMBps(std::string& src) {
+  PaddedBuffer buf(src.data(), src.size());
+  auto start = std::chrono::steady_clock::now();
+  StrStream stream(buf.str(), buf.len, "bench.js");
+  for (;;) {
+    Token t = getToken(stream, 0);
+    if (t.type == Token::EOFF || t.type == Token::ERROR) break;
+  }
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  return src.size() / (1024.0 * 1024.0) / secs.count();
+}
+
+static double validateMBps(std::string& src) {
+  auto start = std::chrono::steady_clock::now();
+  bool ascii;
+  bool valid = validateUtf8(src.data(), src.data() + src.size(), ascii);
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  if (!valid) printf("invalid UTF-8\n");
+  return src.size() / (1024.0 * 1024.0) / secs.count();
+}
+
+static double prelexMBps(std::string& src) {
+  PaddedBuffer buf(src.data(), src.size());
+  auto start = std::chrono::steady_clock::now();
+  StrStream stream(buf.str(), buf.len, "bench.js");
+  TokenArray tokens;
+  tokens.lex(stream);
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  return src.size() / (1024.0 * 1024.0) / secs.count();
+}
+
+int main() {
+  almond::init();
+
+  const size_t size = 16 << 20;
+
+  std::string mixed = makeNumberInput(size);
+  printf("numbers (mixed)   %8.1f MB/s\n", lexMBps(mixed));
+
+  std::string ints = makeIntInput(size);
+  printf("numbers (ints)    %8.1f MB/s\n", lexMBps(ints));
+
+  std::string asmjs = makeAsmInput(size);
+  printf("asm.js            %8.1f MB/s\n", lexMBps(asmjs));
+  printf("asm.js (prelex)   %8.1f MB/s\n", prelexMBps(asmjs));
+  printf("asm.js (parse)    %8.1f MB/s\n", parseMBps(asmjs));
+  printf("asm.js (chunked)  %8.1f MB/s\n", chunkedMBps(asmjs, 64));
+
+  std::string nested = makeNestedInput(size);
+  printf("nested (parse)    %8.1f MB/s\n", parseMBps(nested));
+
+  std::string idents = makeIdentInput(size);
+  printf("identifiers       %8.1f MB/s\n", lexMBps(idents));
+
+  std::string spaces = makeSpaceInput(size);
+  printf("whitespace        %8.1f MB/s\n", lexMBps(spaces));
+
+  std::string strings = makeStringInput(size);
+  printf("string literal    %8.1f MB/s\n", lexMBps(strings));
+
+  const char* lateError =
+    "var a = 1, b = 2;\n"
+    "function f(x) { return x + a * b; }\n"
+    "if (f(a) > b) { a = b; } else { b = a; }\n"
+    "var 5;\n";
+  printf("failed parses (early error) %8.0f /s\n", failedParsesPerSec("var 5;", 1 << 20));
+  printf("failed parses (late error)  %8.0f /s\n", failedParsesPerSec(lateError, 1 << 18));
+
+  std::string unicode;
+  while (unicode.size() < size) unicode += "var \u03c0 = '\u00e9t\u00e9 \u4e2d\u6587 \U0001f600';\n";
+
+  // Scanning kernels of each tier supported by the host
+  SimdLevel best = getSimdLevel();
+  for (int i = 0; i <= best; ++i) {
+    setSimdLevel((SimdLevel)i);
+    printf("[%s]\n", simdLevelNames[i]);
+    printf("  whitespace      %8.1f MB/s\n", lexMBps(spaces));
+    printf("  string literal  %8.1f MB/s\n", lexMBps(strings));
+    printf("  utf-8 (ascii)   %8.1f MB/s\n", validateMBps(idents));
+    printf("  utf-8 (mixed)   %8.1f MB/s\n", validateMBps(unicode));
+  }
+  setSimdLevel(best);
+}
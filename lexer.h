@@ -36,13 +36,32 @@
 *****************************************************************************/
 
 #include <string>
-#include <algorithm> // for sort
-#include <regex>
-
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include <algorithm> // for upper_bound
+#include <charconv> // for from_chars
+
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define ALMOND_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "simd.h"
+#include "unicode.h"
+
 namespace almond {
 
 /**
@@ -170,26 +189,279 @@ OpInfo operators[] = {
 #define NUM_OPERATORS sizeof(operators)/sizeof(operators[0])
 
 /**
-Separator tokens
+Operator and separator identifiers, one per distinct token string
+*/
+enum OpId
+{
+    OP_NONE,
+
+    // Separators
+    OP_COMMA,
+    OP_COLON,
+    OP_SEMI,
+    OP_LPAREN,
+    OP_RPAREN,
+    OP_LBRACKET,
+    OP_RBRACKET,
+    OP_LBRACE,
+    OP_RBRACE,
+
+    // Punctuation operators
+    OP_DOT,
+    OP_INC,
+    OP_DEC,
+    OP_PLUS,
+    OP_MINUS,
+    OP_NOT,
+    OP_BITNOT,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_SHL,
+    OP_SHR,
+    OP_USHR,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_STRICT_EQ,
+    OP_STRICT_NE,
+    OP_BITAND,
+    OP_BITXOR,
+    OP_BITOR,
+    OP_AND,
+    OP_OR,
+    OP_QUESTION,
+    OP_ASSIGN,
+    OP_ADD_ASSIGN,
+    OP_SUB_ASSIGN,
+    OP_MUL_ASSIGN,
+    OP_DIV_ASSIGN,
+    OP_MOD_ASSIGN,
+    OP_AND_ASSIGN,
+    OP_OR_ASSIGN,
+    OP_XOR_ASSIGN,
+    OP_SHL_ASSIGN,
+    OP_SHR_ASSIGN,
+    OP_USHR_ASSIGN,
+
+    // Word operators
+    OP_NEW,
+    OP_TYPEOF,
+    OP_VOID,
+    OP_DELETE,
+    OP_IN,
+    OP_INSTANCEOF,
+
+    NUM_OP_IDS
+};
+
+/**
+Token strings, indexed by operator/separator identifier
+*/
+const char* opStrings[NUM_OP_IDS] = {
+    "",
+    ",", ":", ";", "(", ")", "[", "]", "{", "}",
+    ".", "++", "--", "+", "-", "!", "~", "*", "/", "%",
+    "<<", ">>", ">>>", "<", "<=", ">", ">=", "==", "!=", "===", "!==",
+    "&", "^", "|", "&&", "||", "?",
+    "=", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "<<=", ">>=", ">>>=",
+    "new", "typeof", "void", "delete", "in", "instanceof"
+};
+
+/**
+Test if an identifier denotes a separator token
+*/
+bool isSepId(int id)
+{
+    return id >= OP_COMMA && id <= OP_RBRACE;
+}
+
+/**
+Test if an identifier denotes a word operator (e.g.: "in", "typeof")
+*/
+bool isWordOpId(int id)
+{
+    return id >= OP_NEW && id <= OP_INSTANCEOF;
+}
+
+/**
+Handler applied by the expression loop to an operator token found
+after a complete operand
+*/
+enum InfixKind : uint8_t
+{
+    INFIX_NONE,
+    INFIX_BINARY,
+    INFIX_COMPOUND_ASSIGN,
+    INFIX_POSTFIX,
+    INFIX_CALL,
+    INFIX_INDEX,
+    INFIX_MEMBER,
+    INFIX_TERNARY
+};
+
+/**
+Expression parsing rule for an operator or separator token
+*/
+struct OpRule
+{
+    /// Handler in infix/postfix position
+    InfixKind infix;
+
+    /// Precedence in infix/postfix position
+    int8_t prec;
+
+    /// Right-to-left associativity of the infix form
+    bool rightAssoc;
+
+    /// Precedence in prefix position, -1 if not a prefix operator
+    int8_t prefixPrec;
+
+    /// Binary operator applied by a compound assignment (e.g.: + for +=)
+    OpId baseOp;
+};
+
+/**
+Expression parsing rules, indexed by operator/separator identifier.
+Mirrors the operator table above, so that the expression parser can
+find precedence and associativity without string lookups.
 */
-std::string separators[] = {
-    ",",
-    ":",
-    ";",
-    "(",
-    ")",
-    "[",
-    "]",
-    "{",
-    "}"
+struct OpRuleTable
+{
+    OpRule rules[NUM_OP_IDS];
+
+    constexpr OpRuleTable() : rules()
+    {
+        for (int id = 0; id < NUM_OP_IDS; ++id)
+            rules[id] = { INFIX_NONE, -1, false, -1, OP_NONE };
+
+        infix(OP_DOT, INFIX_MEMBER, 16);
+        infix(OP_LBRACKET, INFIX_INDEX, 16);
+        prefix(OP_NEW, 16);
+        infix(OP_LPAREN, INFIX_CALL, 15);
+
+        infix(OP_INC, INFIX_POSTFIX, 14);
+        infix(OP_DEC, INFIX_POSTFIX, 14);
+
+        prefix(OP_PLUS, 13);
+        prefix(OP_MINUS, 13);
+        prefix(OP_NOT, 13);
+        prefix(OP_BITNOT, 13);
+        prefix(OP_INC, 13);
+        prefix(OP_DEC, 13);
+        prefix(OP_TYPEOF, 13);
+        prefix(OP_VOID, 13);
+        prefix(OP_DELETE, 13);
+
+        infix(OP_MUL, INFIX_BINARY, 12);
+        infix(OP_DIV, INFIX_BINARY, 12);
+        infix(OP_MOD, INFIX_BINARY, 12);
+        infix(OP_PLUS, INFIX_BINARY, 11);
+        infix(OP_MINUS, INFIX_BINARY, 11);
+        infix(OP_SHL, INFIX_BINARY, 10);
+        infix(OP_SHR, INFIX_BINARY, 10);
+        infix(OP_USHR, INFIX_BINARY, 10);
+
+        infix(OP_LT, INFIX_BINARY, IN_PREC);
+        infix(OP_LE, INFIX_BINARY, IN_PREC);
+        infix(OP_GT, INFIX_BINARY, IN_PREC);
+        infix(OP_GE, INFIX_BINARY, IN_PREC);
+        infix(OP_IN, INFIX_BINARY, IN_PREC);
+        infix(OP_INSTANCEOF, INFIX_BINARY, IN_PREC);
+
+        infix(OP_EQ, INFIX_BINARY, 8);
+        infix(OP_NE, INFIX_BINARY, 8);
+        infix(OP_STRICT_EQ, INFIX_BINARY, 8);
+        infix(OP_STRICT_NE, INFIX_BINARY, 8);
+
+        infix(OP_BITAND, INFIX_BINARY, 7);
+        infix(OP_BITXOR, INFIX_BINARY, 6);
+        infix(OP_BITOR, INFIX_BINARY, 5);
+        infix(OP_AND, INFIX_BINARY, 4);
+        infix(OP_OR, INFIX_BINARY, 3);
+
+        infix(OP_QUESTION, INFIX_TERNARY, 2, true);
+
+        infix(OP_ASSIGN, INFIX_BINARY, 1, true);
+        compound(OP_ADD_ASSIGN, OP_PLUS);
+        compound(OP_SUB_ASSIGN, OP_MINUS);
+        compound(OP_MUL_ASSIGN, OP_MUL);
+        compound(OP_DIV_ASSIGN, OP_DIV);
+        compound(OP_MOD_ASSIGN, OP_MOD);
+        compound(OP_AND_ASSIGN, OP_BITAND);
+        compound(OP_OR_ASSIGN, OP_BITOR);
+        compound(OP_XOR_ASSIGN, OP_BITXOR);
+        compound(OP_SHL_ASSIGN, OP_SHL);
+        compound(OP_SHR_ASSIGN, OP_SHR);
+        compound(OP_USHR_ASSIGN, OP_USHR);
+
+        infix(OP_COMMA, INFIX_BINARY, COMMA_PREC);
+    }
+
+    constexpr void infix(OpId id, InfixKind kind, int prec, bool rightAssoc = false)
+    {
+        rules[id].infix = kind;
+        rules[id].prec = prec;
+        rules[id].rightAssoc = rightAssoc;
+    }
+
+    constexpr void prefix(OpId id, int prec)
+    {
+        rules[id].prefixPrec = prec;
+    }
+
+    constexpr void compound(OpId id, OpId baseOp)
+    {
+        infix(id, INFIX_COMPOUND_ASSIGN, 1, true);
+        rules[id].baseOp = baseOp;
+    }
+
+    constexpr const OpRule& operator[] (int id) const
+    {
+        return rules[id];
+    }
 };
 
-#define NUM_SEPARATORS sizeof(separators)/sizeof(separators[0])
+constexpr OpRuleTable opRules;
+
+/**
+Keyword identifiers
+*/
+enum KwId
+{
+    KW_NONE,
+    KW_VAR,
+    KW_FUNCTION,
+    KW_IF,
+    KW_ELSE,
+    KW_DO,
+    KW_WHILE,
+    KW_FOR,
+    KW_BREAK,
+    KW_CONTINUE,
+    KW_RETURN,
+    KW_SWITCH,
+    KW_CASE,
+    KW_DEFAULT,
+    KW_THROW,
+    KW_TRY,
+    KW_CATCH,
+    KW_FINALLY,
+    KW_TRUE,
+    KW_FALSE,
+    KW_NULL,
+
+    NUM_KW_IDS
+};
 
 /**
-Keyword tokens
+Keyword tokens, indexed by keyword identifier
 */
-std::string keywords[] = {
+const char* keywords[NUM_KW_IDS] = {
+    "",
     "var",
     "function",
     "if",
@@ -212,18 +484,12 @@ std::string keywords[] = {
     "null"
 };
 
-#define NUM_KEYWORDS sizeof(keywords)/sizeof(keywords[0])
-
 /**
-Static module constructor to initialize the
-separator, keyword and op tables
+Static module constructor to select the scanning kernels
 */
 void init()
 {
-    // Sort the tables by decreasing string length
-    std::sort(operators, operators + NUM_OPERATORS, [](OpInfo a, OpInfo b) { return a.str.size() > b.str.size(); });
-    std::sort(separators, separators + NUM_SEPARATORS, [](std::string a, std::string b) { return a.size() > b.size(); });
-    std::sort(keywords, keywords + NUM_KEYWORDS, [](std::string a, std::string b) { return a.size() > b.size(); });
+    initSimd();
 }
 
 /**
@@ -250,6 +516,12 @@ Operator findOperator(std::string op, int arity = 0, char assoc = '\0')
     return nullptr;
 }
 
+/**
+Byte offset into a source string. 64 bits wide, so that single inputs
+are not limited to 4 GB.
+*/
+typedef uint64_t SrcOfs;
+
 /**
 Source code position
 */
@@ -259,12 +531,12 @@ struct SrcPos
     std::string file;
 
     /// Line number
-    int line;
+    SrcOfs line;
 
     /// Column number
-    int col;
+    SrcOfs col;
 
-    SrcPos(std::string file_, int line_, int col_)
+    SrcPos(std::string file_, SrcOfs line_, SrcOfs col_)
     {
         file = file_;
         line = line_;
@@ -278,490 +550,1508 @@ struct SrcPos
 };
 
 /**
-String stream, used to lex from strings
+Interned identifier handle
 */
-struct StrStream
-{
-    /// Input string
-    char* str;
-    int strLen;
+typedef uint32_t Atom;
 
-    /// File name
-    std::string file;
+/**
+Symbol table interning identifier names into small integer atoms. Each
+distinct name is stored once, and its storage is stable for the lifetime
+of the table.
+*/
+struct SymbolTable
+{
+    /// Interned names, indexed by atom
+    std::deque<std::string> names;
 
-    // Current index
-    int index;
+    /// Name hashes, indexed by atom
+    std::vector<uint32_t> hashes;
 
-    /// Current line number
-    int line;
+    /// Open addressing hash index holding atom + 1, or 0 for empty slots
+    std::vector<Atom> slots;
 
-    /// Current column
-    int col;
+    SymbolTable() : slots(1024, 0) {}
 
-    StrStream(char* str_, std::string file_) : index(0), line(1), col(1)
+    /// FNV-1a hash of a name
+    static uint32_t hash(const char* str, size_t len)
     {
-        str = str_;
-        strLen = strlen(str);
-        file = file_;
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i)
+            h = (h ^ (uint8_t)str[i]) * 16777619u;
+        return h;
     }
 
-    /// Read a character and advance the current index
-    char readCh()
+    /// Get the atom for a name, adding the name if not yet present
+    Atom intern(const char* str, size_t len)
     {
-        char ch = (index < strLen) ? str[index] : '\0';
-
-        index++;
+        uint32_t h = hash(str, len);
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
 
-        if (ch == '\n')
-        {
-            line++;
-            col = 1;
-        }
-        else if (ch != '\r')
+        for (; slots[i] != 0; i = (i + 1) & mask)
         {
-            col++;
+            Atom atom = slots[i] - 1;
+            if (hashes[atom] == h &&
+                names[atom].size() == len &&
+                memcmp(names[atom].data(), str, len) == 0)
+                return atom;
         }
 
-        return ch;
+        Atom atom = (Atom)names.size();
+        names.emplace_back(str, len);
+        hashes.push_back(h);
+        slots[i] = atom + 1;
+
+        // Keep the load factor under one half
+        if (names.size() * 2 > slots.size())
+            rehash(slots.size() * 2);
+
+        return atom;
     }
 
-    /// Read a character without advancing the index
-    char peekCh(size_t ofs = 0)
+    /// Get the name for an atom
+    const std::string& name(Atom atom)
     {
-        char ch = (index + ofs < strLen) ? str[index + ofs] : '\0';
-        return ch;
+        return names[atom];
     }
 
-    /// Test for a match with a given string, the string is consumed if matched
-    bool match(const char *str_)
+    /// Get the number of distinct names
+    size_t size()
     {
-        int str_Len = strlen(str_);
-
-        if (index + str_Len > strLen)
-            return false;
-
-        if (strncmp(str_, str+index, str_Len))
-            return false;
+        return names.size();
+    }
 
-        // Consume the characters
-        for (int i = 0; i < str_Len; ++i)
-            readCh();
+    void rehash(size_t numSlots)
+    {
+        slots.assign(numSlots, 0);
+        size_t mask = numSlots - 1;
 
-        return true;
+        for (Atom atom = 0; atom < names.size(); ++atom)
+        {
+            size_t i = hashes[atom] & mask;
+            while (slots[i] != 0)
+                i = (i + 1) & mask;
+            slots[i] = atom + 1;
+        }
     }
+};
+
+/**
+Table of line start offsets, used to map source offsets to lines and
+columns. Built on first use, so lexing never tracks line numbers.
+*/
+struct LineIndex
+{
+    /// Offset of the first character of each line
+    std::vector<SrcOfs> lineStarts;
 
-    /// Test for a match with a regupar expression
-    std::smatch match(std::regex re)
+    /// Find the line starts of a string
+    void build(const char* str, SrcOfs strLen)
     {
-        std::smatch m;
-        if (std::regex_search(std::string(str), m, re))
+        lineStarts.clear();
+        lineStarts.push_back(0);
+
+        const char* end = str + strLen;
+        for (const char* p = str; (p = (const char*)memchr(p, '\n', end - p)) != nullptr; )
         {
-            for (auto it : m)
-            {
-                for (int i = 0; i < it.length(); ++i)
-                    readCh();
-            }
+            ++p;
+            lineStarts.push_back(p - str);
         }
-        return m;
     }
 
-    /// Get a position object for the current index
-    SrcPos* getPos()
+    /// Get the 1-based line and column numbers for an offset
+    void lookup(SrcOfs ofs, SrcOfs& line, SrcOfs& col)
     {
-        return new SrcPos(file, line, col); // XXX leak
+        auto it = std::upper_bound(lineStarts.begin(), lineStarts.end(), ofs);
+        line = it - lineStarts.begin();
+        col = ofs - *(it - 1) + 1;
     }
 };
 
-
-bool whitespace(char ch)
+/**
+Copy of an input string followed by INPUT_PADDING zero bytes, for callers
+which cannot provide the padding themselves
+*/
+struct PaddedBuffer
 {
-    return (ch == '\r' || ch == '\n' || ch == ' ' || ch == '\t');
-}
+    std::unique_ptr<char[]> data;
+    size_t len;
 
-bool alpha(char ch)
-{
-    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
-}
+    PaddedBuffer() : len(0) {}
 
-bool digit(char ch)
-{
-    return (ch >= '0' && ch <= '9');
-}
+    PaddedBuffer(const char* src, size_t len_) : data(new char[len_ + INPUT_PADDING]), len(len_)
+    {
+        memcpy(data.get(), src, len);
+        memset(data.get() + len, 0, INPUT_PADDING);
+    }
 
-bool identStart(char ch)
-{
-    return alpha(ch) || ch == '_' || ch == '$';
-}
+    const char* str() const
+    {
+        return data.get();
+    }
+};
 
-bool identPart(char ch)
-{
-    return identStart(ch) || digit(ch);
-}
+#if defined(ALMOND_MMAP)
 
-bool ident(const char* str)
-{
-    if (str[0] == 0 || !identStart(str[0]))
-        return false;
+/**
+File mapping flags
+*/
+typedef unsigned int MapFlags;
 
-    while (*str) {
-      if (!identPart(*str))
-            return false;
-      str++;
-    }
+/// Read the whole file into memory when it is mapped
+const MapFlags MMAP_PREFETCH = 1 << 0;
 
-    return true;
-}
+/// Drop the pages behind the lexer from memory as it advances
+const MapFlags MMAP_RELEASE_BEHIND = 1 << 1;
 
 /**
-Source token value
+Read-only memory mapping of a source file, followed by INPUT_PADDING zero
+bytes. The padding comes from the zero tail of the last page of the file,
+and from anonymous pages mapped after it when the tail is too short.
+Dropped pages are read again from the file if they are accessed, so
+releasing them never invalidates a token span.
 */
-struct Token
+struct MappedFile
 {
-    enum Type
-    {
-        OP,
-        SEP,
-        IDENT,
-        KEYWORD,
-        INT,
-        FLOAT,
-        STRING,
-        REGEXP,
-        EOFF,
-        ERROR
-    };
+    /// Pages are released in steps of this many bytes, and only once they
+    /// are this far behind the lexer, so that backtracking stays cheap
+    static const size_t RELEASE_STEP = 4 << 20;
 
-    /// Token type
-    Type type;
+    /// File contents
+    const char* data;
+    size_t size;
 
-    /// Token value
-    union
-    {
-        long intVal;
-        double floatVal;
-        std::string stringVal;
-        struct {
-            std::string regexpVal;
-            std::string flagsVal;
-        };
-    };
+    /// Length of the mapping, including the padding
+    size_t mapLen;
 
-    bool operator==(Token& other)
-    {
-        if (type != other.type) return false;
-        if (type == INT) return intVal == other.intVal;
-        if (type == FLOAT) return floatVal == other.floatVal;
-        if (type == STRING) return stringVal == other.stringVal;
-        if (type == REGEXP) return regexpVal == other.regexpVal && flagsVal == other.flagsVal;
-        return true;
-    }
+    /// Page size of the host
+    size_t pageSize;
 
-    /// Source position
-    SrcPos* pos;
+    /// Offset up to which pages were released
+    size_t released;
 
-    Token(Type type_, long val_, SrcPos* pos_) : type(type_), intVal(val_), pos(pos_)
-    {
-        assert (type_ == INT);
-    }
+    MapFlags flags;
+
+    MappedFile() : data(nullptr), size(0), mapLen(0), pageSize(0), released(0), flags(0) {}
 
-    Token(Type type_, double val_, SrcPos* pos_) : type(type_), floatVal(val_), pos(pos_)
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
     {
-        assert (type_ == FLOAT);
+        close();
     }
 
-    Token(Type type_, std::string val_, SrcPos* pos_) : type(type_), stringVal(val_), pos(pos_)
+    /// Map a file. Returns false if it cannot be opened or mapped.
+    bool open(const std::string& path, MapFlags flags_ = MMAP_RELEASE_BEHIND)
     {
-        assert (
-            type_ == OP      ||
-            type_ == SEP     ||
-            type_ == IDENT   ||
-            type_ == KEYWORD ||
-            type_ == STRING  ||
-            type_ == ERROR
-        );
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        size = st.st_size;
+        flags = flags_;
+        released = 0;
+        pageSize = sysconf(_SC_PAGESIZE);
+        mapLen = (size + INPUT_PADDING + pageSize - 1) & ~(pageSize - 1);
+
+        // Reserve zero pages for the file and the padding, then map the
+        // file over them
+        void* base = mmap(nullptr, mapLen, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        int mapFlags = MAP_PRIVATE | MAP_FIXED;
+#if defined(MAP_POPULATE)
+        if (flags & MMAP_PREFETCH)
+            mapFlags |= MAP_POPULATE;
+#endif
+
+        if (size > 0 && mmap(base, size, PROT_READ, mapFlags, fd, 0) == MAP_FAILED)
+        {
+            munmap(base, mapLen);
+            ::close(fd);
+            return false;
+        }
+
+        ::close(fd);
+        data = (const char*)base;
+
+        madvise(base, mapLen, (flags & MMAP_PREFETCH)? MADV_WILLNEED:MADV_SEQUENTIAL);
+        return true;
     }
 
-    Token(Type type_, std::string re_, std::string flags_, SrcPos* pos_) : type(type_), regexpVal(re_), flagsVal(flags_), pos(pos_)
+    void close()
     {
-        assert (type == REGEXP);
+        if (data)
+            munmap((void*)data, mapLen);
+        data = nullptr;
+        size = 0;
+        mapLen = 0;
     }
 
-    Token(Type type_, SrcPos* pos_) : type(type_), pos(pos_)
+    /// Drop the whole pages of a byte range from memory
+    void drop(size_t begin, size_t end)
     {
-        assert (type == EOFF);
+        begin = (begin + pageSize - 1) & ~(pageSize - 1);
+        end &= ~(pageSize - 1);
+        if (begin < end)
+            madvise((void*)(data + begin), end - begin, MADV_DONTNEED);
     }
 
-    std::string toString()
+    /// Release the pages far enough behind the lexer position
+    void releaseBehind(size_t ofs)
     {
-        return "TODO: Token";
-        /*
-        switch (type)
-        {
-
-            case OP:        return format("op:%s"  , stringVal);
-            case SEP:       return format("separator:%s" , stringVal);
-            case IDENT:     return format("identifier:%s", stringVal);
-            case KEYWORD:   return format("keyword:%s"   , stringVal);
-            case INT:       return format("int:%s"       , intVal);
-            case FLOAT:     return format("float:%f"     , floatVal);
-            case STRING:    return format("string:%s"    , stringVal);
-            case REGEXP:    return format("regexp:/%s/%s", regexpVal, flagsVal);
-            case ERROR:     return format("error:%s"     , stringVal);
-            case EOFF:       return "EOFF";
+        if (!(flags & MMAP_RELEASE_BEHIND) || ofs < released + 2 * RELEASE_STEP)
+            return;
 
-            default:
-            return "token";
-        }
-        */
+        size_t end = ofs - RELEASE_STEP;
+        drop(released, end);
+        released = end;
     }
 };
 
-/**
-Lexer flags, used to parameterize lexical analysis
-*/
-typedef unsigned int LexFlags;
-const LexFlags LEX_MAYBE_RE = 1 << 0;
+#endif
 
 /**
-Read a character escape sequence
+String stream, used to lex from strings. The input may contain NUL
+characters if it is followed by INPUT_PADDING zero bytes. A NUL-terminated
+input without padding is lexed in place with the scalar kernels, and the
+lexer never reads past its terminator.
 */
-int readEscape(StrStream& stream)
+struct StrStream
 {
-    assert(0);
-    /*
-    // Hexadecimal escape sequence regular expressions
-    enum hexRegex = ctRegex!(`^x([0-9|a-f|A-F]{2})`w);
-    enum uniRegex = ctRegex!(`^u([0-9|a-f|A-F]{4})`w);
+    /// Input string
+    const char* str;
+    SrcOfs strLen;
 
-    // Try to match a hexadecimal escape sequence
-    auto m = stream.match(hexRegex);
-    if (m.empty == true)
-        m = stream.match(uniRegex);
-    if (m.empty == false)
-    {
-        auto hexStr = m.captures[1];
+    /// File name
+    std::string file;
 
-        int charCode;
-        formattedRead(hexStr, "%x", &charCode);
+    // Current index
+    SrcOfs index;
 
-        return charCode;
-    }
+    /// Identifiers interned during the parse
+    SymbolTable symbols;
 
-    // Octal escape sequence regular expression
-    enum octRegex = ctRegex!(`^([0-7][0-7]?[0-7]?)`w);
+    /// Line start table, empty until a position is requested
+    LineIndex lines;
 
-    // Try to match an octal escape sequence
-    m = stream.match(octRegex);
-    if (m.empty == false)
-    {
-        auto octStr = m.captures[1];
+    /// Input encoding, checked when the stream is created
+    bool validUtf8;
+    bool ascii;
 
-        int charCode;
-        formattedRead(octStr, "%o", &charCode);
+    /// Set when a token stream lexes a token reaching the end of the
+    /// input, which tells an incremental parse that more input could
+    /// change it
+    bool reachedEnd = false;
 
-        return charCode;
-    }
+    /// Scanning kernels, the selected ones if the input is padded
+    const SimdKernels* kernels = &simdKernels;
 
-    auto code = stream.readCh();
+#if defined(ALMOND_MMAP)
+    /// Mapped file the input comes from, if any
+    MappedFile* mapping = nullptr;
+#endif
 
-    // Switch on the escape code
-    switch (code)
+    /// Lex from an input followed by INPUT_PADDING zero bytes
+    StrStream(const char* str_, size_t len_, std::string file_) : index(0)
     {
-        case 'r' : return '\r';
-        case 'n' : return '\n';
-        case 'v' : return '\v';
-        case 't' : return '\t';
-        case 'f' : return '\f';
-        case 'b' : return '\b';
-        case 'a' : return '\a';
-        case '\\': return '\\';
-        case '\"': return '\"';
-        case '\'': return '\'';
-
-        // Multiline string continuation
-        case '\n': return -1;
-
-        // By default, add the escape character as is
-        default:
-        return code;
+        str = str_;
+        strLen = len_;
+        file = file_;
+        validUtf8 = validateUtf8(str, str + strLen, ascii);
     }
-    */
-}
 
-/**
-Get the first token from a stream
-*/
-Token* getToken(StrStream& stream, LexFlags flags)
-{
-    char ch;
+    /// Lex from a NUL-terminated string, without copying it
+    StrStream(const char* str_, std::string file_) : index(0)
+    {
+        str = str_;
+        strLen = strlen(str_);
+        file = file_;
+        kernels = &scalarKernels;
+        validUtf8 = validateUtf8(str, str + strLen, ascii);
+    }
 
-    // Consume whitespace and comments
-    for (;;)
+#if defined(ALMOND_MMAP)
+    /// Lex from a mapped file. With MMAP_RELEASE_BEHIND, the file is
+    /// validated in steps and each step is dropped from memory after it
+    /// is validated, so the whole file is never resident at once.
+    StrStream(MappedFile& mapping_, std::string file_) : index(0)
     {
-        ch = stream.peekCh();
-//printf("peek char %d (%c)\n", ch, ch);
+        str = mapping_.data;
+        strLen = mapping_.size;
+        file = file_;
+        mapping = &mapping_;
 
-        // Whitespace characters
-        if (whitespace(ch))
+        if (!(mapping->flags & MMAP_RELEASE_BEHIND))
         {
-            stream.readCh();
+            validUtf8 = validateUtf8(str, str + strLen, ascii);
+            return;
         }
 
-        // Single-line comment
-        else if (stream.match("//"))
-        {
-            for (;;)
-            {
-                ch = stream.readCh();
-                if (ch == '\n' || ch == '\0')
-                    break;
-            }
-        }
+        validUtf8 = true;
+        ascii = true;
 
-        // Multi-line comment
-        else if (stream.match("/*"))
+        const char* end = str + strLen;
+        for (const char* p = str; p < end && validUtf8; )
         {
-            for (;;)
+            const char* cut = end;
+            if ((size_t)(end - p) > MappedFile::RELEASE_STEP)
             {
-                if (stream.match("*/"))
-                    break;
-                if (stream.peekCh() == '\0')
-                    return new Token(
-                        Token::ERROR,
-                        "end of stream in multi-line comment", 
-                        stream.getPos()
-                    );
-                ch = stream.readCh();
+                // Do not split a UTF-8 sequence
+                cut = p + MappedFile::RELEASE_STEP;
+                for (int i = 0; i < 3 && ((uint8_t)*cut & 0xC0) == 0x80; ++i)
+                    --cut;
             }
-        }
 
-        // Otherwise
-        else
-        {
-            break;
+            bool stepAscii;
+            validUtf8 = validateUtf8(p, cut, stepAscii);
+            ascii = ascii && stepAscii;
+
+            mapping->drop(p - str, cut - str);
+            p = cut;
         }
     }
+#endif
 
-    // Get the position at the start of the token
-    SrcPos* pos = stream.getPos();
-//printf("curr char %d (%c)\n", ch, ch);
+    /// Test if the current index is at the end of the input
+    bool atEnd()
+    {
+        return index >= strLen;
+    }
 
-    // Number (starting with a digit or .nxx)
-    if (digit(ch) || (ch == '.' && digit(stream.peekCh(1))))
+    /// Read a character and advance the current index. Reads zero at the
+    /// end of the input.
+    char readCh()
+    {
+        return str[index++];
+    }
+
+    /// Read a character without advancing the index
+    char peekCh(SrcOfs ofs = 0)
+    {
+        return str[index + ofs];
+    }
+
+    /// Test for a match with a given string, the string is consumed if matched
+    bool match(const char *str_)
+    {
+        SrcOfs str_Len = strlen(str_);
+
+        if (index + str_Len > strLen)
+            return false;
+
+        if (memcmp(str_, str+index, str_Len))
+            return false;
+
+        index += str_Len;
+        return true;
+    }
+
+    /// Advance over a number of characters
+    void skip(SrcOfs numChars)
+    {
+        index += numChars;
+    }
+
+    /// Get the position of a source offset. Only used for error
+    /// reporting, the line index is built on the first call.
+    SrcPos getPos(SrcOfs ofs)
+    {
+        if (lines.lineStarts.empty())
+            lines.build(str, strLen);
+
+        SrcOfs line, col;
+        lines.lookup(ofs, line, col);
+        return SrcPos(file, line, col);
+    }
+};
+
+/**
+Character class bits
+*/
+typedef uint8_t CharClass;
+const CharClass CC_SPACE = 1 << 0;
+const CharClass CC_ALPHA = 1 << 1;
+const CharClass CC_DIGIT = 1 << 2;
+const CharClass CC_IDENT_START = 1 << 3;
+const CharClass CC_IDENT_PART = 1 << 4;
+
+/**
+Character class table, indexed by byte value. Bytes above 0x7F have no
+class here, non-ASCII identifiers are looked up in the tables of unicode.h.
+*/
+struct CharClassTable
+{
+    CharClass classes[256];
+
+    constexpr CharClassTable() : classes()
+    {
+        for (int ch = 0; ch < 256; ++ch)
+        {
+            CharClass c = 0;
+
+            if (ch == '\r' || ch == '\n' || ch == ' ' || ch == '\t')
+                c |= CC_SPACE;
+            if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'))
+                c |= CC_ALPHA | CC_IDENT_START | CC_IDENT_PART;
+            if (ch >= '0' && ch <= '9')
+                c |= CC_DIGIT | CC_IDENT_PART;
+            if (ch == '_' || ch == '$')
+                c |= CC_IDENT_START | CC_IDENT_PART;
+
+            classes[ch] = c;
+        }
+    }
+
+    constexpr CharClass operator[] (char ch) const
+    {
+        return classes[(uint8_t)ch];
+    }
+};
+
+constexpr CharClassTable charClasses;
+
+bool whitespace(char ch)
+{
+    return charClasses[ch] & CC_SPACE;
+}
+
+bool alpha(char ch)
+{
+    return charClasses[ch] & CC_ALPHA;
+}
+
+bool digit(char ch)
+{
+    return charClasses[ch] & CC_DIGIT;
+}
+
+bool identStart(char ch)
+{
+    return charClasses[ch] & CC_IDENT_START;
+}
+
+bool identPart(char ch)
+{
+    return charClasses[ch] & CC_IDENT_PART;
+}
+
+/// Returned by decodeUtf8 for malformed sequences
+const uint32_t INVALID_CODE_POINT = 0xFFFFFFFF;
+
+/**
+Decode a UTF-8 sequence and set its length. Malformed sequences decode to
+INVALID_CODE_POINT with a length of 1. The input must be padded.
+*/
+uint32_t decodeUtf8(const char* p, int& len)
+{
+    const uint8_t* s = (const uint8_t*)p;
+    auto cont = [s](int i) { return (s[i] & 0xC0) == 0x80; };
+
+    len = 1;
+
+    if (s[0] < 0x80)
+        return s[0];
+
+    if (s[0] >= 0xC2 && s[0] < 0xE0 && cont(1))
+    {
+        len = 2;
+        return ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+    }
+
+    if (s[0] >= 0xE0 && s[0] < 0xF0 && cont(1) && cont(2))
+    {
+        uint32_t cp = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        if (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))
+            return INVALID_CODE_POINT;
+        len = 3;
+        return cp;
+    }
+
+    if (s[0] >= 0xF0 && s[0] < 0xF5 && cont(1) && cont(2) && cont(3))
+    {
+        uint32_t cp =
+            ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) |
+            ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        if (cp < 0x10000 || cp > 0x10FFFF)
+            return INVALID_CODE_POINT;
+        len = 4;
+        return cp;
+    }
+
+    return INVALID_CODE_POINT;
+}
+
+/**
+Test if a non-ASCII character encoded in UTF-8 starts an identifier
+*/
+bool uniIdentStartAt(const char* p)
+{
+    int len;
+    return uniIdentStart.contains(decodeUtf8(p, len));
+}
+
+/**
+Continue scanning an identifier at a non-ASCII character
+*/
+const char* scanUniIdent(const char* p)
+{
+    for (;;)
+    {
+        int len;
+        if ((uint8_t)*p < 0x80 || !uniIdentPart.contains(decodeUtf8(p, len)))
+            return p;
+        p += len;
+
+        while (charClasses[*p] & CC_IDENT_PART)
+            ++p;
+    }
+}
+
+/**
+Find the end of an identifier. The input must be padded, so that it is
+terminated by a character which is not an identifier part.
+*/
+const char* scanIdent(const char* p)
+{
+    while (charClasses[*p] & CC_IDENT_PART)
+        ++p;
+
+    // Non-ASCII identifier characters, rare
+    if ((uint8_t)*p >= 0x80)
+        return scanUniIdent(p);
+
+    return p;
+}
+
+bool ident(const char* str)
+{
+    if (str[0] == 0 || !identStart(str[0]))
+        return false;
+
+    while (*str) {
+      if (!identPart(*str))
+            return false;
+      str++;
+    }
+
+    return true;
+}
+
+/**
+Token flags, set by the lexer
+*/
+typedef uint8_t TokFlags;
+const TokFlags TOK_NL_BEFORE = 1 << 0;
+const TokFlags TOK_ESCAPES = 1 << 1;
+
+/**
+Source token value. Tokens are plain values: the token text is a span of
+the input buffer and numeric values are decoded into the token itself.
+*/
+struct Token
+{
+    enum Type : uint8_t
+    {
+        OP,
+        SEP,
+        IDENT,
+        KEYWORD,
+        INT,
+        FLOAT,
+        STRING,
+        REGEXP,
+        EOFF,
+        ERROR
+    };
+
+    /// Token value
+    union
+    {
+        /// Interned identifier name
+        Atom atom;
+
+        /// Integer value
+        long intVal;
+
+        /// Floating-point value
+        double floatVal;
+
+        /// Length of the flags at the end of a regular expression
+        uint32_t flagsLen;
+
+        /// Error message
+        const char* errorMsg;
+    };
+
+    /// Source offset of the first character
+    SrcOfs ofs;
+
+    /// Length of the token text, longer tokens are lexing errors
+    uint32_t len;
+
+    /// Operator, separator or keyword identifier
+    uint16_t id;
+
+    /// Token type
+    Type type;
+
+    /// Token flags
+    TokFlags flags;
+
+    Token() = default;
+
+    Token(Type type_, Atom atom_, SrcOfs start, SrcOfs end) : atom(atom_), ofs(start), len(end - start), id(OP_NONE), type(type_), flags(0)
+    {
+        assert (type_ == IDENT);
+    }
+
+    Token(Type type_, long val_, SrcOfs start, SrcOfs end) : intVal(val_), ofs(start), len(end - start), id(OP_NONE), type(type_), flags(0)
+    {
+        assert (type_ == INT);
+    }
+
+    Token(Type type_, double val_, SrcOfs start, SrcOfs end) : floatVal(val_), ofs(start), len(end - start), id(OP_NONE), type(type_), flags(0)
+    {
+        assert (type_ == FLOAT);
+    }
+
+    Token(Type type_, OpId id_, SrcOfs start, SrcOfs end) : intVal(0), ofs(start), len(end - start), id(id_), type(type_), flags(0)
+    {
+        assert (type_ == OP || type_ == SEP);
+    }
+
+    Token(Type type_, KwId id_, SrcOfs start, SrcOfs end) : intVal(0), ofs(start), len(end - start), id(id_), type(type_), flags(0)
+    {
+        assert (type_ == KEYWORD);
+    }
+
+    Token(Type type_, const char* msg_, SrcOfs start) : errorMsg(msg_), ofs(start), len(0), id(OP_NONE), type(type_), flags(0)
+    {
+        assert (type_ == ERROR);
+    }
+
+    Token(Type type_, SrcOfs start, SrcOfs end) : intVal(0), ofs(start), len(end - start), id(OP_NONE), type(type_), flags(0)
+    {
+        assert (type_ == STRING || type_ == REGEXP || type_ == EOFF);
+    }
+
+    /// Test if two tokens are the same token of the input
+    bool operator==(const Token& other) const
+    {
+        return type == other.type && ofs == other.ofs && len == other.len;
+    }
+
+    /// Get the text of the token
+    std::string_view text(const char* src) const
+    {
+        return std::string_view(src + ofs, len);
+    }
+
+    /// Get the contents of a string literal, without the quotes
+    std::string_view stringVal(const char* src) const
+    {
+        assert (type == STRING);
+        return std::string_view(src + ofs + 1, len - 2);
+    }
+
+    /// Get the pattern of a regular expression literal
+    std::string_view regexpVal(const char* src) const
+    {
+        assert (type == REGEXP);
+        return std::string_view(src + ofs + 1, len - 2 - flagsLen);
+    }
+
+    /// Get the flags of a regular expression literal
+    std::string_view flagsVal(const char* src) const
+    {
+        assert (type == REGEXP);
+        return std::string_view(src + ofs + len - flagsLen, flagsLen);
+    }
+
+    std::string toString() const
+    {
+        return "TODO: Token";
+        /*
+        switch (type)
+        {
+
+            case OP:        return format("op:%s"  , stringVal);
+            case SEP:       return format("separator:%s" , stringVal);
+            case IDENT:     return format("identifier:%s", stringVal);
+            case KEYWORD:   return format("keyword:%s"   , stringVal);
+            case INT:       return format("int:%s"       , intVal);
+            case FLOAT:     return format("float:%f"     , floatVal);
+            case STRING:    return format("string:%s"    , stringVal);
+            case REGEXP:    return format("regexp:/%s/%s", regexpVal, flagsVal);
+            case ERROR:     return format("error:%s"     , stringVal);
+            case EOFF:       return "EOFF";
+
+            default:
+            return "token";
+        }
+        */
+    }
+};
+
+static_assert(
+    sizeof(Token) == 24 && std::is_trivially_copyable_v<Token>,
+    "tokens must stay 24-byte plain values"
+);
+
+/**
+Lexer flags, used to parameterize lexical analysis
+*/
+typedef unsigned int LexFlags;
+const LexFlags LEX_MAYBE_RE = 1 << 0;
+
+/**
+Number of characters past the end of a token which the lexer may read to
+find where the token ends, as in "1e+5"
+*/
+const SrcOfs LEX_LOOKAHEAD = 3;
+
+/**
+Powers of ten which are exactly representable as doubles
+*/
+const double exactPow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+Get the value of a hexadecimal digit, or -1 if not a hex digit
+*/
+int hexDigit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/**
+Append a code point to a string in UTF-8. Lone surrogates, which string
+literals may contain, are encoded like other code points.
+*/
+void appendUtf8(std::string& out, uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        out += (char)cp;
+    }
+    else if (cp < 0x800)
+    {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+/**
+Read a fixed number of hexadecimal digits. Returns -1 if there are fewer.
+*/
+int32_t readHex(const char*& p, const char* end, int numDigits)
+{
+    if (end - p < numDigits)
+        return -1;
+
+    int32_t val = 0;
+    for (int i = 0; i < numDigits; ++i)
+    {
+        int d = hexDigit(p[i]);
+        if (d < 0)
+            return -1;
+        val = (val << 4) | d;
+    }
+
+    p += numDigits;
+    return val;
+}
+
+/// Returned by readEscape for line continuations, which add no character
+const uint32_t NO_CODE_POINT = 0xFFFFFFFE;
+
+/**
+Read a character escape sequence, after the backslash. Returns the code
+point it denotes. Malformed hexadecimal and unicode escapes denote the
+escaped character itself.
+*/
+uint32_t readEscape(const char*& p, const char* end)
+{
+    if (p >= end)
+        return '\\';
+
+    char code = *p++;
+
+    switch (code)
+    {
+        case 'r': return '\r';
+        case 'n': return '\n';
+        case 'v': return '\v';
+        case 't': return '\t';
+        case 'f': return '\f';
+        case 'b': return '\b';
+
+        // Hexadecimal escape sequence
+        case 'x':
+        {
+            int32_t val = readHex(p, end, 2);
+            return (val >= 0)? val:'x';
+        }
+
+        // Unicode escape sequence, 4 digits or a braced code point
+        case 'u':
+        {
+            if (p < end && *p == '{')
+            {
+                const char* q = p + 1;
+                uint32_t cp = 0;
+                while (q < end && hexDigit(*q) >= 0 && cp <= 0x10FFFF)
+                    cp = (cp << 4) | hexDigit(*q++);
+
+                if (q == p + 1 || q >= end || *q != '}' || cp > 0x10FFFF)
+                    return 'u';
+
+                p = q + 1;
+                return cp;
+            }
+
+            int32_t val = readHex(p, end, 4);
+            if (val < 0)
+                return 'u';
+
+            // Combine surrogate pairs
+            if (val >= 0xD800 && val <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+            {
+                const char* q = p + 2;
+                int32_t low = readHex(q, end, 4);
+                if (low >= 0xDC00 && low <= 0xDFFF)
+                {
+                    p = q;
+                    return 0x10000 + ((val - 0xD800) << 10) + (low - 0xDC00);
+                }
+            }
+
+            return val;
+        }
+
+        // Multiline string continuation
+        case '\r':
+        if (p < end && *p == '\n')
+            p++;
+        return NO_CODE_POINT;
+
+        case '\n':
+        return NO_CODE_POINT;
+
+        default:
+        break;
+    }
+
+    // Legacy octal escape sequence, up to \377
+    if (code >= '0' && code <= '7')
+    {
+        uint32_t val = code - '0';
+        int maxDigits = (code <= '3')? 2:1;
+        for (int i = 0; i < maxDigits && p < end && *p >= '0' && *p <= '7'; ++i)
+            val = (val << 3) | (*p++ - '0');
+        return val;
+    }
+
+    // Line and paragraph separators continue the line
+    if ((uint8_t)code == 0xE2 && end - p >= 2 && (uint8_t)p[0] == 0x80 && ((uint8_t)p[1] & 0xFE) == 0xA8)
+    {
+        p += 2;
+        return NO_CODE_POINT;
+    }
+
+    // Other characters stand for themselves
+    if ((uint8_t)code >= 0x80 && utf8SeqLength(p - 1, end) > 0)
+    {
+        int len;
+        uint32_t cp = decodeUtf8(p - 1, len);
+        p += len - 1;
+        return cp;
+    }
+
+    return (uint8_t)code;
+}
+
+/**
+Decode the escape sequences of a string literal into UTF-8
+*/
+std::string decodeString(std::string_view raw)
+{
+    std::string out;
+    out.reserve(raw.size());
+
+    const char* p = raw.data();
+    const char* end = p + raw.size();
+
+    while (p < end)
+    {
+        const char* bs = (const char*)memchr(p, '\\', end - p);
+        if (bs == nullptr)
+            bs = end;
+
+        out.append(p, bs - p);
+        if (bs == end)
+            break;
+
+        p = bs + 1;
+        uint32_t cp = readEscape(p, end);
+        if (cp != NO_CODE_POINT)
+            appendUtf8(out, cp);
+    }
+
+    return out;
+}
+
+/**
+Value of a string literal, decoded on demand. The text is a view of the
+source, and escape sequences are only decoded when a consumer converts it
+to a string. Builders which take a std::string get the decoded value.
+*/
+struct StringLiteral
+{
+    /// Source text between the quotes
+    std::string_view raw;
+
+    /// Set if the text contains escape sequences
+    bool hasEscapes;
+
+    /// Get the value, decoding escape sequences if there are any
+    std::string decode() const
     {
-        // Hexadecimal number
-        if (stream.match("0x"))
+        return hasEscapes? decodeString(raw):std::string(raw);
+    }
+
+    /// Get the value as a view of the source, without escape sequences
+    std::string_view view() const
+    {
+        assert (!hasEscapes);
+        return raw;
+    }
+
+    operator std::string() const
+    {
+        return decode();
+    }
+};
+
+/**
+Read a numeric literal. Integers are accumulated directly, floating-point
+values take an exact fast path when the significand fits in 53 bits and
+the power of ten is exactly representable (Clinger's algorithm), and are
+otherwise converted by from_chars, which is correctly rounded.
+*/
+Token readNumber(StrStream& stream)
+{
+    SrcOfs pos = stream.index;
+    const char* start = stream.str + stream.index;
+    const char* p = start;
+
+    // Hexadecimal number
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+        p += 2;
+        const char* digits = p;
+
+        uint64_t val = 0;
+        while (hexDigit(*p) >= 0)
+        {
+            val = (val << 4) | hexDigit(*p);
+            p++;
+        }
+
+        if (p == digits)
+        {
+            return Token(
+                Token::ERROR,
+                "invalid hex number",
+                pos
+            );
+        }
+
+        stream.skip(p - start);
+
+        // Skip leading zeros to find the significant digits
+        while (*digits == '0' && digits < p - 1)
+            digits++;
+
+        // Values too large for an integer token are rounded to a double
+        if (p - digits > 15)
+        {
+            double fval;
+            auto res = std::from_chars(digits, p, fval, std::chars_format::hex);
+            if (res.ec == std::errc::result_out_of_range)
+                fval = HUGE_VAL;
+            return Token(Token::FLOAT, fval, pos, stream.index);
+        }
+
+        return Token(Token::INT, (long)val, pos, stream.index);
+    }
+
+    // Legacy octal number, only if all the digits are octal
+    if (p[0] == '0' && digit(p[1]))
+    {
+        const char* q = p + 1;
+        while (*q == '0')
+            q++;
+        const char* digits = q;
+
+        // Keep the leading 21 significant digits (63 bits), and whether
+        // any of the digits dropped past them is nonzero
+        uint64_t val = 0;
+        int dropped = 0;
+        bool inexact = false;
+        while (*q >= '0' && *q <= '7')
+        {
+            if (q - digits < 21)
+            {
+                val = (val << 3) | (*q - '0');
+            }
+            else
+            {
+                dropped++;
+                inexact |= (*q != '0');
+            }
+            q++;
+        }
+
+        if (!digit(*q) && *q != '.' && *q != 'e' && *q != 'E')
+        {
+            stream.skip(q - start);
+
+            // Values too large for an integer token are rounded to a
+            // double. The dropped digits only act as a sticky bit below
+            // the 53 significant bits, so the result is correctly rounded.
+            if (q - digits > 15)
+            {
+                double fval = ldexp((double)(val | inexact), 3 * dropped);
+                return Token(Token::FLOAT, fval, pos, stream.index);
+            }
+
+            return Token(Token::INT, (long)val, pos, stream.index);
+        }
+    }
+
+    // Decimal number, accumulate up to 19 significant digits
+    uint64_t mant = 0;
+    int numDigits = 0;
+    int exp10 = 0;
+    bool truncated = false;
+    bool isFloat = false;
+
+    for (; digit(*p); ++p)
+    {
+        if (numDigits < 19)
+        {
+            mant = mant * 10 + (*p - '0');
+            if (mant != 0)
+                numDigits++;
+        }
+        else
+        {
+            exp10++;
+            truncated = true;
+        }
+    }
+
+    if (*p == '.')
+    {
+        isFloat = true;
+
+        for (++p; digit(*p); ++p)
+        {
+            if (numDigits < 19)
+            {
+                mant = mant * 10 + (*p - '0');
+                if (mant != 0)
+                    numDigits++;
+                exp10--;
+            }
+            else
+            {
+                truncated = true;
+            }
+        }
+    }
+
+    // Exponent, only if followed by at least one digit
+    if ((*p == 'e' || *p == 'E') &&
+        (digit(p[1]) || ((p[1] == '+' || p[1] == '-') && digit(p[2]))))
+    {
+        isFloat = true;
+
+        p++;
+        bool negExp = false;
+        if (*p == '+' || *p == '-')
+            negExp = (*p++ == '-');
+
+        int expVal = 0;
+        for (; digit(*p); ++p)
+        {
+            if (expVal < 100000)
+                expVal = expVal * 10 + (*p - '0');
+        }
+
+        exp10 += negExp ? -expVal : expVal;
+    }
+
+    stream.skip(p - start);
+
+    // Integer number
+    if (!isFloat && !truncated && mant <= (uint64_t)LONG_MAX)
+    {
+        return Token(Token::INT, (long)mant, pos, stream.index);
+    }
+
+    // Exact fast path, both operands and the result are exact doubles
+    if (!truncated && mant <= (1ull << 53) && exp10 >= -22 && exp10 <= 22)
+    {
+        double val = (double)mant;
+        if (exp10 < 0)
+            val /= exactPow10[-exp10];
+        else
+            val *= exactPow10[exp10];
+        return Token(Token::FLOAT, val, pos, stream.index);
+    }
+
+    // Out of range values overflow to infinity or underflow to zero
+    double val;
+    if (std::from_chars(start, p, val).ec == std::errc::result_out_of_range)
+        val = (exp10 > 0) ? HUGE_VAL : 0.0;
+    return Token(Token::FLOAT, val, pos, stream.index);
+}
+
+/**
+Recognize the longest operator or separator at the start of a string.
+Dispatches on the first character, so each token is matched in a single
+pass. Returns the token length, or 0 if there is no match.
+*/
+int matchOp(const char* p, OpId& id)
+{
+    switch (p[0])
+    {
+        case ',': id = OP_COMMA; return 1;
+        case ':': id = OP_COLON; return 1;
+        case ';': id = OP_SEMI; return 1;
+        case '(': id = OP_LPAREN; return 1;
+        case ')': id = OP_RPAREN; return 1;
+        case '[': id = OP_LBRACKET; return 1;
+        case ']': id = OP_RBRACKET; return 1;
+        case '{': id = OP_LBRACE; return 1;
+        case '}': id = OP_RBRACE; return 1;
+        case '.': id = OP_DOT; return 1;
+        case '~': id = OP_BITNOT; return 1;
+        case '?': id = OP_QUESTION; return 1;
+
+        case '+':
+        if (p[1] == '+') { id = OP_INC; return 2; }
+        if (p[1] == '=') { id = OP_ADD_ASSIGN; return 2; }
+        id = OP_PLUS; return 1;
+
+        case '-':
+        if (p[1] == '-') { id = OP_DEC; return 2; }
+        if (p[1] == '=') { id = OP_SUB_ASSIGN; return 2; }
+        id = OP_MINUS; return 1;
+
+        case '*':
+        if (p[1] == '=') { id = OP_MUL_ASSIGN; return 2; }
+        id = OP_MUL; return 1;
+
+        case '/':
+        if (p[1] == '=') { id = OP_DIV_ASSIGN; return 2; }
+        id = OP_DIV; return 1;
+
+        case '%':
+        if (p[1] == '=') { id = OP_MOD_ASSIGN; return 2; }
+        id = OP_MOD; return 1;
+
+        case '^':
+        if (p[1] == '=') { id = OP_XOR_ASSIGN; return 2; }
+        id = OP_BITXOR; return 1;
+
+        case '&':
+        if (p[1] == '&') { id = OP_AND; return 2; }
+        if (p[1] == '=') { id = OP_AND_ASSIGN; return 2; }
+        id = OP_BITAND; return 1;
+
+        case '|':
+        if (p[1] == '|') { id = OP_OR; return 2; }
+        if (p[1] == '=') { id = OP_OR_ASSIGN; return 2; }
+        id = OP_BITOR; return 1;
+
+        case '!':
+        if (p[1] == '=')
+        {
+            if (p[2] == '=') { id = OP_STRICT_NE; return 3; }
+            id = OP_NE; return 2;
+        }
+        id = OP_NOT; return 1;
+
+        case '=':
+        if (p[1] == '=')
+        {
+            if (p[2] == '=') { id = OP_STRICT_EQ; return 3; }
+            id = OP_EQ; return 2;
+        }
+        id = OP_ASSIGN; return 1;
+
+        case '<':
+        if (p[1] == '<')
         {
-            static std::regex hexRegex("^[0-9|a-f|A-F]+");
-            auto m = stream.match(hexRegex);
+            if (p[2] == '=') { id = OP_SHL_ASSIGN; return 3; }
+            id = OP_SHL; return 2;
+        }
+        if (p[1] == '=') { id = OP_LE; return 2; }
+        id = OP_LT; return 1;
 
-            if (m.empty())
+        case '>':
+        if (p[1] == '>')
+        {
+            if (p[2] == '>')
             {
-                return new Token(
-                    Token::ERROR,
-                    "invalid hex number", 
-                    pos
-                );
+                if (p[3] == '=') { id = OP_USHR_ASSIGN; return 4; }
+                id = OP_USHR; return 3;
             }
+            if (p[2] == '=') { id = OP_SHR_ASSIGN; return 3; }
+            id = OP_SHR; return 2;
+        }
+        if (p[1] == '=') { id = OP_GE; return 2; }
+        id = OP_GT; return 1;
+
+        default:
+        return 0;
+    }
+}
 
-            auto hexStr = m[0];
-            long val;
-            scanf(hexStr.str().c_str(), "%x", &val);
+/**
+Classify a word as a keyword, a word operator or a plain identifier.
+Switches on the length and first character, so at most one string
+comparison is made. The keyword or operator identifier is stored in id.
+*/
+Token::Type classifyWord(const char* p, size_t len, int& id)
+{
+    auto is = [&](const char* word) { return memcmp(p, word, len) == 0; };
 
-            return new Token(Token::INT, val, pos);
+    switch (len)
+    {
+        case 2:
+        if (p[0] == 'i' && p[1] == 'f') { id = KW_IF; return Token::KEYWORD; }
+        if (p[0] == 'i' && p[1] == 'n') { id = OP_IN; return Token::OP; }
+        if (p[0] == 'd' && p[1] == 'o') { id = KW_DO; return Token::KEYWORD; }
+        break;
+
+        case 3:
+        switch (p[0])
+        {
+            case 'v': if (is("var")) { id = KW_VAR; return Token::KEYWORD; } break;
+            case 'f': if (is("for")) { id = KW_FOR; return Token::KEYWORD; } break;
+            case 't': if (is("try")) { id = KW_TRY; return Token::KEYWORD; } break;
+            case 'n': if (is("new")) { id = OP_NEW; return Token::OP; } break;
         }
+        break;
 
-        // Octal number
-        if (ch == '0')
+        case 4:
+        switch (p[0])
         {
-            static std::regex octRegex("^0([0-7]+)");
+            case 'e': if (is("else")) { id = KW_ELSE; return Token::KEYWORD; } break;
+            case 'c': if (is("case")) { id = KW_CASE; return Token::KEYWORD; } break;
+            case 't': if (is("true")) { id = KW_TRUE; return Token::KEYWORD; } break;
+            case 'n': if (is("null")) { id = KW_NULL; return Token::KEYWORD; } break;
+            case 'v': if (is("void")) { id = OP_VOID; return Token::OP; } break;
+        }
+        break;
 
-            auto m = stream.match(octRegex);
-            if (!m.empty())
-            {
-                auto octStr = m[1];
-                long val;
-                scanf(octStr.str().c_str(), "%o", &val);
-                return new Token(Token::INT, val, pos);
-            }
+        case 5:
+        switch (p[0])
+        {
+            case 'w': if (is("while")) { id = KW_WHILE; return Token::KEYWORD; } break;
+            case 'b': if (is("break")) { id = KW_BREAK; return Token::KEYWORD; } break;
+            case 't': if (is("throw")) { id = KW_THROW; return Token::KEYWORD; } break;
+            case 'c': if (is("catch")) { id = KW_CATCH; return Token::KEYWORD; } break;
+            case 'f': if (is("false")) { id = KW_FALSE; return Token::KEYWORD; } break;
         }
+        break;
 
-        static std::regex fpRegex("^[0-9]*\.?[0-9]+([eE][-+]?[0-9]+)?");
+        case 6:
+        switch (p[0])
+        {
+            case 'r': if (is("return")) { id = KW_RETURN; return Token::KEYWORD; } break;
+            case 's': if (is("switch")) { id = KW_SWITCH; return Token::KEYWORD; } break;
+            case 't': if (is("typeof")) { id = OP_TYPEOF; return Token::OP; } break;
+            case 'd': if (is("delete")) { id = OP_DELETE; return Token::OP; } break;
+        }
+        break;
 
-        auto m = stream.match(fpRegex);
-        assert (m.empty() == false);
-        auto numStr = m[0].str().c_str();
+        case 7:
+        switch (p[0])
+        {
+            case 'd': if (is("default")) { id = KW_DEFAULT; return Token::KEYWORD; } break;
+            case 'f': if (is("finally")) { id = KW_FINALLY; return Token::KEYWORD; } break;
+        }
+        break;
 
-        // If this is a floating-point number
-        if (strchr(numStr, '.') ||
-            strchr(numStr, 'e') ||
-            strchr(numStr, 'E'))
+        case 8:
+        switch (p[0])
         {
-            double val = atof(numStr);
-            return new Token(Token::FLOAT, val, pos);
+            case 'f': if (is("function")) { id = KW_FUNCTION; return Token::KEYWORD; } break;
+            case 'c': if (is("continue")) { id = KW_CONTINUE; return Token::KEYWORD; } break;
         }
+        break;
 
-        // Integer number
-        else
+        case 10:
+        if (is("instanceof")) { id = OP_INSTANCEOF; return Token::OP; }
+        break;
+    }
+
+    id = 0;
+    return Token::IDENT;
+}
+
+/**
+Skip an escape sequence in a string or regexp body, from its backslash to
+the character after the escaped one. A CRLF line continuation skips both
+line bytes. A backslash at the end of the input only skips itself, so the
+lexer stays on the terminator of an input without padding.
+*/
+const char* skipEscape(const char* p, const char* end)
+{
+    if (p + 1 >= end)
+        return p + 1;
+
+    return p + ((p[1] == '\r' && p[2] == '\n')? 3:2);
+}
+
+/**
+Read a token at the current position, after whitespace and comments
+*/
+Token readToken(StrStream& stream, LexFlags flags)
+{
+    char ch = stream.peekCh();
+
+    // Get the position at the start of the token
+    SrcOfs pos = stream.index;
+
+    // Identifier or keyword, the most common case
+    if (identStart(ch) ||
+        ((uint8_t)ch >= 0x80 && uniIdentStartAt(stream.str + stream.index)))
+    {
+        const char* start = stream.str + stream.index;
+        size_t len = scanIdent(start) - start;
+        stream.skip(len);
+
+        int id;
+        switch (classifyWord(start, len, id))
         {
-            long val = atoi(numStr);
-            return new Token(Token::INT, val, pos);
+            case Token::KEYWORD:
+            return Token(Token::KEYWORD, (KwId)id, pos, stream.index);
+
+            case Token::OP:
+            return Token(Token::OP, (OpId)id, pos, stream.index);
+
+            default:
+            return Token(Token::IDENT, stream.symbols.intern(start, len), pos, stream.index);
         }
     }
 
+    // Number (starting with a digit or .nxx)
+    if (digit(ch) || (ch == '.' && digit(stream.peekCh(1))))
+    {
+        return readNumber(stream);
+    }
+
     // String constant
     if (ch == '"' || ch == '\'')
     {
-        auto openChar = stream.readCh();
-
-        std::string str = "";
+        const char* end = stream.str + stream.strLen;
+        const char* p = stream.str + stream.index + 1;
+        TokFlags escapes = 0;
 
-        // Until the end of the string
+        // Until the end of the string, skipping over runs
+        // of plain characters
         for (;;)
         {
-            ch = stream.readCh();
+            p = stream.kernels->findQuote(p, ch);
 
-            if (ch == openChar)
+            if (*p == ch)
             {
                 break;
             }
 
-            // End of file
-            else if (ch == '\0')
+            // End of file, or a NUL character in the string
+            else if (*p == '\0')
             {
-                return new Token(
-                    Token::ERROR,
-                    "EOF in string literal",
-                    stream.getPos()
-                );
+                if (p >= end)
+                {
+                    stream.index = stream.strLen;
+                    return Token(
+                        Token::ERROR,
+                        "EOF in string literal",
+                        stream.index
+                    );
+                }
+
+                p++;
             }
 
             // End of line
-            else if (ch == '\n')
+            else if (*p == '\n')
             {
-                return new Token(
+                stream.index = p + 1 - stream.str;
+                return Token(
                     Token::ERROR,
                     "newline in string literal",
-                    stream.getPos()
+                    stream.index
                 );
             }
 
-            // Escape sequence
-            else if (ch == '\\')
-            {
-                auto escCh = readEscape(stream);
-                if (escCh != -1)
-                    str += escCh;
-            }
-
-            // Normal character
+            // Escape sequence, the value is a span of the
+            // input and escapes are decoded by the consumer
             else
             {
-                str += ch;
+                escapes = TOK_ESCAPES;
+                p = skipEscape(p, end);
             }
         }
 
-        return new Token(Token::STRING, str, pos);
+        stream.index = p + 1 - stream.str;
+        Token t(Token::STRING, pos, stream.index);
+        t.flags = escapes;
+        return t;
     }
 
     // Quasi literal
@@ -770,133 +2060,100 @@ Token* getToken(StrStream& stream, LexFlags flags)
         // TODO: full support for quasi-literals
         // for now, quasis are only multi-line strings
 
-        // Read the opening ` character
-        auto openChar = stream.readCh();
-
-        std::string str = "";
+        const char* end = stream.str + stream.strLen;
+        const char* p = stream.str + stream.index + 1;
+        TokFlags escapes = 0;
 
         // Until the end of the string
         for (;;)
         {
-            ch = stream.readCh();
+            p = stream.kernels->findQuote(p, ch);
 
-            if (ch == openChar)
+            if (*p == ch)
             {
                 break;
             }
 
             // End of file
-            else if (ch == '\0')
+            else if (*p == '\0' && p >= end)
             {
-                return new Token(
+                stream.index = stream.strLen;
+                return Token(
                     Token::ERROR,
                     "EOF in string literal",
-                    stream.getPos()
+                    stream.index
                 );
             }
 
-            // Escape sequence
-            else if (ch == '\\')
+            // Newlines and NUL characters are allowed in quasis
+            else if (*p == '\n' || *p == '\0')
             {
-                auto escCh = readEscape(stream);
-                if (escCh != -1)
-                    str += escCh;
+                p++;
             }
 
-            // Normal character
+            // Escape sequence
             else
             {
-                str += ch;
+                escapes = TOK_ESCAPES;
+                p = skipEscape(p, end);
             }
         }
 
-        return new Token(Token::STRING, str, pos);
-    }
-
-    // End of file
-    if (ch == '\0')
-    {
-        return new Token(Token::EOFF, pos);
+        stream.index = p + 1 - stream.str;
+        Token t(Token::STRING, pos, stream.index);
+        t.flags = escapes;
+        return t;
     }
 
-    // Identifier or keyword
-    if (identStart(ch))
+    // End of file, NUL characters in the input are invalid
+    if (ch == '\0' && stream.atEnd())
     {
-        stream.readCh();
-        std::string identStr;
-        identStr += ch;
-
-        for (;;)
-        {
-            ch = stream.peekCh();
-            if (identPart(ch) == false)
-                break;
-            stream.readCh();
-            identStr += ch;
-        }
-
-        // Try matching all keywords
-        for (auto keyword : keywords)
-            if (identStr == keyword)
-                return new Token(Token::KEYWORD, identStr, pos);
-
-        // Try matching all ops
-        for (auto op : operators)
-            if (identStr == op.str)
-                return new Token(Token::OP, identStr, pos);
-
-        return new Token(Token::IDENT, identStr, pos);
+        return Token(Token::EOFF, pos, pos);
     }
 
     // Regular expression
     if ((flags & LEX_MAYBE_RE) && ch == '/')
     {
-        // Read the opening slash
-        stream.readCh();
+        const char* end = stream.str + stream.strLen;
+        const char* p = stream.str + stream.index + 1;
 
         // Read the pattern
-        std::string reStr = "";
         for (;;)
         {
-            ch = stream.readCh();
-
-            // Escape sequence
-            // Note: other escape sequences are
-            // handled by the regexp parser
-            if (ch == '\\')
-            {
-                if (stream.peekCh() == '/')
-                {
-                    stream.readCh();
-                    reStr += "\\/";
-                    continue;
-                }
-
-                if (stream.peekCh() == '\\')
-                {
-                    stream.readCh();
-                    reStr += "\\\\";
-                    continue;
-                }
-            }
+            p = stream.kernels->findQuote(p, '/');
 
             // End of regexp literal
-            if (ch == '/')
+            if (*p == '/')
             {
                 break;
             }
 
             // End of file
-            if (ch == '\0')
+            else if (*p == '\0' && p >= end)
+            {
+                stream.index = stream.strLen;
+                return Token(Token::ERROR, "EOF in literal", stream.index);
+            }
+
+            // Escape sequence, skip the escaped character
+            // Note: escape sequences are interpreted by
+            // the regexp parser
+            else if (*p == '\\')
             {
-                return new Token(Token::ERROR, "EOF in literal", stream.getPos());
+                p = skipEscape(p, end);
             }
 
-            reStr += ch;
+            // Line feed or NUL character, not special here
+            else
+            {
+                p++;
+            }
         }
 
+        stream.index = p + 1 - stream.str;
+
         // Read the flags
-        std::string reFlags = "";
+        SrcOfs flagsStart = stream.index;
         for (;;)
         {
             ch = stream.peekCh();
@@ -905,151 +2162,442 @@ Token* getToken(StrStream& stream, LexFlags flags)
                 break;
 
             stream.readCh();
-            reFlags += ch;
         }
 
-        //writefln("reStr: \"%s\"", reStr);
+        Token t(Token::REGEXP, pos, stream.index);
+        t.flagsLen = stream.index - flagsStart;
+        return t;
+    }
 
-        return new Token(Token::REGEXP, reStr, reFlags, pos);
+    // Separator or operator
+    OpId opId;
+    if (int opLen = matchOp(stream.str + stream.index, opId))
+    {
+        stream.skip(opLen);
+        return Token(isSepId(opId) ? Token::SEP : Token::OP, opId, pos, stream.index);
     }
 
-    // Try matching all separators
-    for (auto sep : separators)
-        if (stream.match(sep.c_str()))
-            return new Token(Token::SEP, sep, pos);
+    // Invalid character
+    stream.readCh();
+    return Token(Token::ERROR, "unexpected character", pos);
+}
+
+/**
+Get the first token from a stream
+*/
+Token getToken(StrStream& stream, LexFlags flags)
+{
+    char ch;
 
-    // Try matching all ops
-    for (auto op : operators)
-        if (stream.match(op.str.c_str()))
-            return new Token(Token::OP, op.str, pos);
+    // Flag indicating a newline occurs before the token
+    bool nlBefore = false;
 
-    // Invalid character
-    assert(0);
-    /*
-    int charVal = stream.readCh();
-    std::string charStr;
-    if (charVal >= 33 && charVal <= 126)
-        charStr += "'"w ~ cast(char)charVal ~ "', ";
-    charStr += to!std::string(format("0x%04x", charVal));
-    return new Token(
-        Token::ERROR,
-        "unexpected character ("w ~ charStr ~ ")", 
-        pos
-    );
-    */
+    const char* end = stream.str + stream.strLen;
+
+    // Consume whitespace and comments
+    for (;;)
+    {
+        ch = stream.peekCh();
+        const char* p = stream.str + stream.index;
+
+        // Whitespace characters
+        if (whitespace(ch))
+        {
+            stream.index = stream.kernels->skipSpace(p, nlBefore) - stream.str;
+        }
+
+        // Single-line comment, the newline is consumed with it
+        else if (ch == '/' && stream.peekCh(1) == '/')
+        {
+            const char* nl = stream.kernels->findNewline(p + 2);
+            while (*nl == '\0' && nl < end)
+                nl = stream.kernels->findNewline(nl + 1);
+
+            if (*nl == '\n')
+            {
+                nlBefore = true;
+                nl++;
+            }
+            stream.index = nl - stream.str;
+        }
+
+        // Multi-line comment
+        else if (ch == '/' && stream.peekCh(1) == '*')
+        {
+            const char* close = stream.kernels->findCommentEnd(p + 2, nlBefore);
+            while (*close == '\0' && close < end)
+                close = stream.kernels->findCommentEnd(close + 1, nlBefore);
+
+            if (*close == '\0')
+            {
+                stream.index = stream.strLen;
+                return Token(
+                    Token::ERROR,
+                    "end of stream in multi-line comment",
+                    stream.index
+                );
+            }
+            stream.index = close + 2 - stream.str;
+        }
+
+        // Otherwise
+        else
+        {
+            break;
+        }
+    }
+
+    Token t = readToken(stream, flags);
+    if (nlBefore)
+        t.flags |= TOK_NL_BEFORE;
+
+    // Only the length of literals can realistically overflow
+    if (stream.index - t.ofs > UINT32_MAX && t.type != Token::ERROR)
+        return Token(Token::ERROR, "token too long", t.ofs);
+
+    return t;
 }
 
 /**
-Token stream, to simplify parsing
+Test if a regular expression literal may follow a token. This is the
+case when the token cannot end an expression, so that a slash after it
+cannot be a division operator.
 */
-struct TokenStream
+bool regexAllowedAfter(const Token& t)
+{
+    switch (t.type)
+    {
+        case Token::OP:
+        return t.id != OP_INC && t.id != OP_DEC;
+
+        case Token::SEP:
+        return t.id != OP_RPAREN && t.id != OP_RBRACKET && t.id != OP_RBRACE;
+
+        case Token::KEYWORD:
+        return t.id != KW_TRUE && t.id != KW_FALSE && t.id != KW_NULL;
+
+        default:
+        return false;
+    }
+}
+
+/**
+Pre-lexed tokens of a whole input, in struct-of-arrays layout. Gives the
+parser O(1) access to any token, and can be reused by other tools.
+*/
+struct TokenArray
 {
-    /// String stream before the next token
-    StrStream* preStream;
+    /// Token types
+    std::vector<Token::Type> types;
+
+    /// Token flags
+    std::vector<TokFlags> flags;
+
+    /// Operator, separator or keyword identifiers
+    std::vector<uint16_t> ids;
+
+    /// Source offsets
+    std::vector<SrcOfs> offsets;
+
+    /// Token text lengths
+    std::vector<uint32_t> lengths;
+
+    /// Payload of each token: the atom of an identifier, the index of a
+    /// number in intVals or floatVals, the flags length of a regexp or
+    /// the index of an error message
+    std::vector<uint32_t> payloads;
+
+    /// Integer literal values
+    std::vector<long> intVals;
+
+    /// Floating-point literal values
+    std::vector<double> floatVals;
+
+    /// Error messages
+    std::vector<const char*> errorMsgs;
+
+    /// Get the number of tokens, including the final EOF or error token
+    size_t size() const
+    {
+        return types.size();
+    }
+
+    /// Append a token
+    void push(const Token& t)
+    {
+        uint32_t payload = 0;
+        switch (t.type)
+        {
+            case Token::IDENT:
+            payload = t.atom;
+            break;
+
+            case Token::INT:
+            payload = intVals.size();
+            intVals.push_back(t.intVal);
+            break;
+
+            case Token::FLOAT:
+            payload = floatVals.size();
+            floatVals.push_back(t.floatVal);
+            break;
+
+            case Token::REGEXP:
+            payload = t.flagsLen;
+            break;
+
+            case Token::ERROR:
+            payload = errorMsgs.size();
+            errorMsgs.push_back(t.errorMsg);
+            break;
+
+            default:
+            break;
+        }
+
+        types.push_back(t.type);
+        flags.push_back(t.flags);
+        ids.push_back(t.id);
+        offsets.push_back(t.ofs);
+        lengths.push_back(t.len);
+        payloads.push_back(payload);
+    }
+
+    /// Get a token by index
+    Token get(size_t i) const
+    {
+        Token t;
+        t.type = types[i];
+        t.flags = flags[i];
+        t.id = ids[i];
+        t.ofs = offsets[i];
+        t.len = lengths[i];
+        t.intVal = 0;
+
+        switch (t.type)
+        {
+            case Token::IDENT: t.atom = payloads[i]; break;
+            case Token::INT: t.intVal = intVals[payloads[i]]; break;
+            case Token::FLOAT: t.floatVal = floatVals[payloads[i]]; break;
+            case Token::REGEXP: t.flagsLen = payloads[i]; break;
+            case Token::ERROR: t.errorMsg = errorMsgs[payloads[i]]; break;
+            default: break;
+        }
 
-    /// String stream after the next token
-    StrStream* postStream;
+        return t;
+    }
+
+    /// Reserve space for a number of tokens
+    void reserve(size_t numTokens)
+    {
+        types.reserve(numTokens);
+        flags.reserve(numTokens);
+        ids.reserve(numTokens);
+        offsets.reserve(numTokens);
+        lengths.reserve(numTokens);
+        payloads.reserve(numTokens);
+    }
+
+    /// Lex a string stream up to the end of input or the first error
+    void lex(StrStream& stream)
+    {
+        LexFlags lexFlags = LEX_MAYBE_RE;
+
+        // Typical code averages about four bytes per token. Denser code,
+        // such as asm.js, grows the arrays past this estimate.
+        reserve(size() + (stream.strLen - stream.index) / 4 + 1);
+
+        for (;;)
+        {
+            Token t = getToken(stream, lexFlags);
+            push(t);
+
+            if (t.type == Token::EOFF || t.type == Token::ERROR)
+                break;
+
+            lexFlags = regexAllowedAfter(t) ? LEX_MAYBE_RE : 0;
+        }
+    }
+};
 
-    /// Flag indicating a newline occurs before the next token
-    bool nlPresent;
+/**
+Token stream, to simplify parsing. Tokens are either lexed exactly once
+into a small lookahead ring buffer, or read from a pre-lexed token array.
+*/
+struct TokenStream
+{
+    /// Lookahead buffer size, must be a power of two
+    static const unsigned BUF_SIZE = 4;
 
-    /// Next token to be read
-    Token* nextToken;
+    /// String stream to read tokens from
+    StrStream* stream;
 
-    // Next token available flag
-    bool tokenAvail;
+    /// Stream index after the last buffered token
+    SrcOfs index;
 
-    // Lexer flags used when reading the next token
+    /// Lexer flags for the next token to be lexed
     LexFlags lexFlags;
 
+    /// Ring buffer of lexed tokens not yet read
+    Token buf[BUF_SIZE];
+
+    /// Buffer position of the next token to be read
+    unsigned head;
+
+    /// Number of buffered tokens
+    unsigned count;
+
+    /// Pre-lexed tokens, or null when lexing on demand
+    const TokenArray* tokens;
+
+    /// Index of the next pre-lexed token to be read
+    size_t tokenIdx;
+
+    /// Stream index after the last token read, and lexer flags for the
+    /// token following it, to resume lexing after it
+    SrcOfs readEnd;
+    LexFlags readFlags;
+
     /**
     Constructor to tokenize a string stream
     */
-    TokenStream(StrStream* strStream) : preStream(strStream), postStream(nullptr), nlPresent(false), nextToken(nullptr), tokenAvail(false) {}
+    TokenStream(StrStream* strStream, LexFlags flags = LEX_MAYBE_RE) : stream(strStream), index(strStream->index), lexFlags(flags), head(0), count(0), tokens(nullptr), tokenIdx(0), readEnd(strStream->index), readFlags(flags) {}
 
     /**
-    Copy constructor for this token stream. Allows for backtracking
+    Constructor to read the tokens of a string stream from a token array
     */
-    TokenStream(TokenStream& that)
+    TokenStream(StrStream* strStream, const TokenArray* tokens_) : stream(strStream), index(strStream->index), lexFlags(LEX_MAYBE_RE), head(0), count(0), tokens(tokens_), tokenIdx(0), readEnd(strStream->index), readFlags(LEX_MAYBE_RE)
     {
-        // Copy the string streams
-        preStream = that.preStream;
-        postStream = that.postStream;
-
-        nlPresent = that.nlPresent;
-        nextToken = that.nextToken;
-        tokenAvail = that.tokenAvail;
-        lexFlags = that.lexFlags;
+        assert (tokens->size() > 0);
     }
 
+    /**
+    Copy constructor for this token stream. Allows for backtracking
+    */
+    TokenStream(TokenStream& that) = default;
+
     /**
     Method to backtrack to a previous state
     */
     void backtrack(TokenStream& that)
     {
-        // Copy the string streams
-        preStream = that.preStream;
-        postStream = that.postStream;
+        *this = that;
+    }
 
-        nlPresent = that.nlPresent;
-        nextToken = that.nextToken;
-        tokenAvail = that.tokenAvail;
-        lexFlags = that.lexFlags;
+    /// Get the position of the next token
+    SrcPos getPos()
+    {
+        return stream->getPos(peek().ofs);
     }
 
-    SrcPos* getPos()
+    /// Get the position of a token
+    SrcPos getPos(const Token& t)
     {
-        return preStream->getPos();
+        return stream->getPos(t.ofs);
     }
 
-    Token* peek(LexFlags lexFlags_ = 0)
+    /// Peek at a token ahead of the next one, without consuming it
+    Token peek(unsigned ahead = 0)
     {
-        if (!tokenAvail || lexFlags != lexFlags_)
+        // The last pre-lexed token is the EOF or error token
+        if (tokens)
+            return tokens->get(std::min(tokenIdx + ahead, tokens->size() - 1));
+
+        assert (ahead < BUF_SIZE);
+
+        while (count <= ahead)
         {
-            postStream = preStream;
-            nextToken = getToken(*postStream, lexFlags_);
-            tokenAvail = true;
-            lexFlags = lexFlags_;
+            stream->index = index;
+            Token t = getToken(*stream, lexFlags);
+            index = stream->index;
+
+#if defined(ALMOND_MMAP)
+            if (stream->mapping)
+                stream->mapping->releaseBehind(index);
+#endif
+
+            if (t.ofs + t.len + LEX_LOOKAHEAD > stream->strLen)
+                stream->reachedEnd = true;
+
+            lexFlags = regexAllowedAfter(t) ? LEX_MAYBE_RE : 0;
+            buf[(head + count) & (BUF_SIZE - 1)] = t;
+            count++;
         }
 
-        return nextToken;
+        return buf[(head + ahead) & (BUF_SIZE - 1)];
     }
 
-    Token* read(LexFlags flags = 0)
+    Token read()
     {
-        auto t = peek(flags);
+        auto t = peek();
+
+        // The last (EOF) token is never consumed, so that the parser
+        // reports truncated input as a parse error
+        if (t.type == Token::EOFF)
+            return t;
 
-        // Cannot read the last (EOF) token
-        assert (t->type != Token::EOFF ); // "cannot read final EOF token"
+        readEnd = t.ofs + t.len;
+        readFlags = regexAllowedAfter(t) ? LEX_MAYBE_RE : 0;
 
-        // Read the token
-        preStream = postStream;
-        tokenAvail = false;
+        if (tokens)
+        {
+            tokenIdx++;
+            return t;
+        }
 
-        // Test if a newline occurs before the new front token
-        nlPresent = (peek()->pos->line > t->pos->line);
+        head = (head + 1) & (BUF_SIZE - 1);
+        count--;
 
         return t;
     }
 
+    /// Get the name of an identifier token
+    const std::string& name(const Token& t)
+    {
+        assert (t.type == Token::IDENT);
+        return stream->symbols.name(t.atom);
+    }
+
+    /// Get the source text of a token
+    std::string_view text(const Token& t)
+    {
+        return t.text(stream->str);
+    }
+
+    /// Get the value of a string literal token, decoded on demand
+    StringLiteral stringLit(const Token& t)
+    {
+        return StringLiteral{ t.stringVal(stream->str), (t.flags & TOK_ESCAPES) != 0 };
+    }
+
+    /// Test if a newline occurs before the next token
     bool newline()
     {
-        return nlPresent;
+        return (peek().flags & TOK_NL_BEFORE) != 0;
+    }
+
+    /// Test if the next token is a given keyword
+    bool peekKw(KwId keyword)
+    {
+        auto t = peek();
+        return (t.type == Token::KEYWORD && t.id == keyword);
     }
 
-    bool peekKw(std::string keyword)
+    /// Test if the next token is a given separator
+    bool peekSep(OpId sep)
     {
         auto t = peek();
-        return (t->type == Token::KEYWORD && t->stringVal == keyword);
+        return (t.type == Token::SEP && t.id == sep);
     }
 
-    bool peekSep(std::string sep)
+    /// Test if the next token is a given operator
+    bool peekOp(OpId op)
     {
         auto t = peek();
-        return (t->type == Token::SEP && t->stringVal == sep);
+        return (t.type == Token::OP && t.id == op);
     }
 
-    bool matchKw(std::string keyword)
+    bool matchKw(KwId keyword)
     {
         if (peekKw(keyword) == false)
             return false;
@@ -1058,7 +2606,7 @@ struct TokenStream
         return true;
     }
 
-    bool matchSep(std::string sep)
+    bool matchSep(OpId sep)
     {
         if (peekSep(sep) == false)
             return false;
@@ -1067,9 +2615,18 @@ struct TokenStream
         return true;
     }
 
+    bool matchOp(OpId op)
+    {
+        if (peekOp(op) == false)
+            return false;
+        read();
+
+        return true;
+    }
+
     bool eof()
     {
-        return peek()->type == Token::EOFF;
+        return peek().type == Token::EOFF;
     }
 };
 
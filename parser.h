@@ -38,57 +38,355 @@
 namespace almond {
 
 /**
-Parsing error exception
+Parse error identifiers
+*/
+enum ErrorId : uint16_t
+{
+    ERR_NONE,
+    ERR_CANNOT_OPEN,
+    ERR_INVALID_UTF8,
+    ERR_SHEBANG_EOF,
+    ERR_EXPECTED_SEP,
+    ERR_EXPECTED_KW,
+    ERR_EXPECTED_SEMI,
+    ERR_EXPECTED_IDENT,
+    ERR_BLOCK_EOF,
+    ERR_DUPLICATE_DEFAULT,
+    ERR_INVALID_CATCH,
+    ERR_NO_CATCH_FINALLY,
+    ERR_VAR_IDENT,
+    ERR_EMPTY_STMT,
+    ERR_EXPECTED_IN,
+    ERR_MEMBER_IDENT,
+    ERR_EXPR_EOF,
+    ERR_UNARY_OP,
+    ERR_UNEXPECTED_TOKEN,
+    ERR_EXPECTED_COMMA,
+    ERR_INVALID_PARAM
+};
+
+/**
+Parsing error record. It has a fixed size and is filled in without any
+allocation, the message and the line and column numbers are only
+computed on request.
 */
 struct ParseError
 {
-    std::string msg;
+    /// Error identifier, ERR_NONE if there was no error
+    ErrorId id = ERR_NONE;
+
+    /// Separator, keyword or lexer message the error refers to, if any.
+    /// Always a static string.
+    const char* arg = nullptr;
+
+    /// Source offset
+    SrcOfs ofs = 0;
+
+    /// Line and column numbers, zero until the error is located
+    SrcOfs line = 0;
+    SrcOfs col = 0;
+
+    /**
+    Compute the line and column numbers from the source the error
+    offset refers to
+    */
+    void locate(const char* src)
+    {
+        if (line != 0)
+            return;
+
+        // Only the lines up to the error offset are indexed
+        LineIndex lines;
+        lines.build(src, ofs);
+        lines.lookup(ofs, line, col);
+    }
+
+    std::string message() const
+    {
+        switch (id)
+        {
+            case ERR_NONE:              return "no error";
+            case ERR_CANNOT_OPEN:       return "cannot open file";
+            case ERR_INVALID_UTF8:      return "invalid UTF-8 sequence";
+            case ERR_SHEBANG_EOF:       return "end of input in shebang line";
+            case ERR_EXPECTED_SEP:      return "expected \"" + std::string(arg) + "\" separator";
+            case ERR_EXPECTED_KW:       return "expected \"" + std::string(arg) + "\" keyword";
+            case ERR_EXPECTED_SEMI:     return "expected semicolon or end of statement";
+            case ERR_EXPECTED_IDENT:    return "expected identifier";
+            case ERR_BLOCK_EOF:         return "end of input in block statement";
+            case ERR_DUPLICATE_DEFAULT: return "duplicate default label";
+            case ERR_INVALID_CATCH:     return "invalid catch identifier";
+            case ERR_NO_CATCH_FINALLY:  return "no catch or finally block";
+            case ERR_VAR_IDENT:         return "expected identifier in variable declaration";
+            case ERR_EMPTY_STMT:        return "empty statements must be terminated by semicolons";
+            case ERR_EXPECTED_IN:       return "expected \"in\" keyword";
+            case ERR_MEMBER_IDENT:      return "invalid member identifier";
+            case ERR_EXPR_EOF:          return "end of input inside expression";
+            case ERR_UNARY_OP:          return "invalid unary operator \"" + std::string(arg) + "\"";
+            case ERR_UNEXPECTED_TOKEN:  return arg? ("unexpected token: " + std::string(arg)):"unexpected token";
+            case ERR_EXPECTED_COMMA:    return "expected comma";
+            case ERR_INVALID_PARAM:     return "invalid parameter";
+        }
+
+        return "unknown error";
+    }
+
+    std::string toString() const
+    {
+        return "ParseError: " + message();
+    }
+};
+
+/**
+Points where the parse of a statement or expression is suspended while a
+nested statement or expression is parsed, and resumed once it is complete
+*/
+enum FrameKind : uint8_t
+{
+    FRAME_IF_TEST,
+    FRAME_IF_TRUE,
+    FRAME_IF_FALSE,
+    FRAME_WHILE_TEST,
+    FRAME_WHILE_BODY,
+    FRAME_DO_BODY,
+    FRAME_DO_TEST,
+    FRAME_FOR_DECL,
+    FRAME_FOR_INIT_STMT,
+    FRAME_FOR_INIT_LHS,
+    FRAME_FOR_INIT_EXPR,
+    FRAME_FOR_TEST,
+    FRAME_FOR_INCR,
+    FRAME_FOR_BODY,
+    FRAME_FOR_IN_EXPR,
+    FRAME_FOR_IN_BODY,
+    FRAME_SWITCH_EXPR,
+    FRAME_SWITCH_CASE,
+    FRAME_SWITCH_STMT,
+    FRAME_RETURN,
+    FRAME_THROW,
+    FRAME_TRY_BLOCK,
+    FRAME_CATCH_BLOCK,
+    FRAME_FINALLY_BLOCK,
+    FRAME_VAR_INIT,
+    FRAME_FUNCTION_DECL,
+    FRAME_BLOCK_STMT,
+    FRAME_LABEL,
+    FRAME_EXPR_STMT,
+    FRAME_PAREN,
+    FRAME_PREFIX,
+    FRAME_NEW_BASE,
+    FRAME_NEW_ARGS,
+    FRAME_CALL_ARGS,
+    FRAME_ARRAY_ELEMS,
+    FRAME_INDEX,
+    FRAME_TERNARY_TRUE,
+    FRAME_TERNARY_FALSE,
+    FRAME_BINARY,
+    FRAME_COMPOUND_ASSIGN,
+    FRAME_FUNCTION_BODY
+};
+
+/**
+Parsing steps, each taken by a parsing function that returns the next one
+*/
+enum ParseStep : uint8_t
+{
+    /// Parse a statement
+    STEP_STMT,
+
+    /// Parse an expression, starting with its first operand
+    STEP_EXPR,
+
+    /// Parse the operators following a complete operand
+    STEP_EXPR_TAIL,
+
+    /// Resume the suspended construct with a complete statement or
+    /// expression
+    STEP_RESUME
+};
+
+/**
+Version of the Builder API implemented by a Builder. A version 2 Builder
+declares BUILDER_VERSION as 2, and receives operators as OpId values and
+names as string views. The views point into the source or the symbol
+table, and stay valid until the parse function returns; a Builder keeping
+a name beyond that must copy it. A Builder without BUILDER_VERSION is a
+version 1 Builder, which receives operators and names as std::string.
+*/
+template<class Builder, class = void>
+struct BuilderVersion : std::integral_constant<int, 1> {};
+
+template<class Builder>
+struct BuilderVersion<Builder, std::void_t<decltype(Builder::BUILDER_VERSION)>>
+: std::integral_constant<int, Builder::BUILDER_VERSION> {};
+
+/**
+Adapter presenting a version 1 Builder with the version 2 API used by the
+parser. Operators and names are copied into std::string values.
+*/
+template<class ASTNode, class Builder>
+struct BuilderV1Adapter : Builder
+{
+    static ASTNode* makeBinary(OpId op, ASTNode* left, ASTNode* right)
+    {
+        return Builder::makeBinary(opStrings[op], left, right);
+    }
+
+    static ASTNode* makeUnary(OpId op, ASTNode* expr)
+    {
+        return Builder::makeUnary(opStrings[op], expr);
+    }
+
+    static ASTNode* makeName(std::string_view name)
+    {
+        return Builder::makeName(std::string(name));
+    }
+
+    static ASTNode* makeIndex(ASTNode* base, std::string_view name)
+    {
+        return Builder::makeIndex(base, std::string(name));
+    }
+
+    static ASTNode* makeBreak(std::string_view label)
+    {
+        return Builder::makeBreak(std::string(label));
+    }
+
+    static ASTNode* makeContinue(std::string_view label)
+    {
+        return Builder::makeContinue(std::string(label));
+    }
 
-    /// Source position
-    SrcPos* pos;
+    static ASTNode* makeLabel(std::string_view label, ASTNode* stmt)
+    {
+        return Builder::makeLabel(std::string(label), stmt);
+    }
 
-    ParseError(std::string msg_, SrcPos* pos_) : msg(msg_), pos(pos_)
+    static void appendVar(ASTNode* vars, std::string_view name, ASTNode* init)
     {
-        assert (pos); // "source position is null");
+        Builder::appendVar(vars, std::string(name), init);
     }
 
-    std::string toString()
+    static ASTNode* makeFunction(
+        std::string_view name,
+        ASTNode* params,
+        ASTNode* body
+    )
     {
-        return "ParseError: " + msg;
+        return Builder::makeFunction(std::string(name), params, body);
     }
 };
 
+/**
+Builder API used by the parser for a given Builder
+*/
 template<class ASTNode, class Builder>
+using BuilderApi = typename std::conditional<
+    (BuilderVersion<Builder>::value >= 2),
+    Builder,
+    BuilderV1Adapter<ASTNode, Builder>
+>::type;
+
+/**
+Recursive descent parser. Errors do not unwind the stack with exceptions:
+the first error is recorded in a sticky error record, and every parsing
+function returns as soon as it sees that the parse has failed.
+
+The descent does not recurse on the native stack. The parsing functions
+each take one step, and the constructs waiting for a nested statement or
+expression are kept on a heap-allocated stack of frames.
+*/
+template<class ASTNode, class UserBuilder>
 struct Parser {
 
+typedef BuilderApi<ASTNode, UserBuilder> Builder;
+
+/**
+Suspended construct, with the parts of it parsed so far
+*/
+struct Frame
+{
+    /// Resume point
+    FrameKind kind;
+
+    /// Declared for-in variable, default case seen, first declaration,
+    /// named function, list element seen, or catch clause seen
+    bool flag;
+
+    /// Pending operator
+    OpId op;
+
+    /// Minimum precedence of the suspended expression
+    int minPrec;
+
+    /// Nodes parsed so far
+    ASTNode* a;
+    ASTNode* b;
+    ASTNode* c;
+
+    /// Label, variable or function name, or first token of an
+    /// expression statement
+    Token tok;
+};
+
+/// Error of the last parse
+ParseError error;
+
+/// Stack of suspended constructs, kept between parses to reuse its storage
+std::vector<Frame> frames;
+
+/// Test if the parse has failed
+bool failed() const
+{
+    return error.id != ERR_NONE;
+}
+
+/**
+Record a parse error, unless one was already recorded. Returns null so
+that parsing functions can return the result.
+*/
+ASTNode* fail(ErrorId id, SrcOfs ofs, const char* arg = nullptr)
+{
+    if (!failed())
+    {
+        error.id = id;
+        error.arg = arg;
+        error.ofs = ofs;
+        error.line = 0;
+        error.col = 0;
+    }
+
+    return nullptr;
+}
+
 /**
-Read and consume a separator token. A parse error
-is thrown if the separator is missing.
+Read and consume a separator token. Returns false and records a parse
+error if the separator is missing.
 */
-void readSep(TokenStream& input, std::string sep)
+bool readSep(TokenStream& input, OpId sep)
 {
     if (!input.matchSep(sep))
     {
-        throw new ParseError(
-            "expected \"" + sep + "\" separator",
-            input.getPos()
-        );
+        fail(ERR_EXPECTED_SEP, input.peek().ofs, opStrings[sep]);
+        return false;
     }
+
+    return true;
 }
 
 /**
-Read and consume a keyword token. A parse error
-is thrown if the keyword is missing.
+Read and consume a keyword token. Returns false and records a parse
+error if the keyword is missing.
 */
-void readKw(TokenStream& input, std::string keyword)
+bool readKw(TokenStream& input, KwId keyword)
 {
     if (input.matchKw(keyword) == false)
     {
-        throw new ParseError(
-            "expected \"" + keyword + "\" keyword",
-            input.getPos()
-        );
+        fail(ERR_EXPECTED_KW, input.peek().ofs, keywords[keyword]);
+        return false;
     }
+
+    return true;
 }
 
 /**
@@ -98,8 +396,8 @@ at the current position
 bool peekSemiAuto(TokenStream& input)
 {
     return (
-        input.peekSep(";") ||
-        input.peekSep("}") ||
+        input.peekSep(OP_SEMI) ||
+        input.peekSep(OP_RBRACE) ||
         input.newline() ||
         input.eof()
     );
@@ -108,926 +406,1758 @@ bool peekSemiAuto(TokenStream& input)
 /**
 Read and consume a semicolon or an automatically inserted semicolon
 */
-void readSemiAuto(TokenStream& input)
+bool readSemiAuto(TokenStream& input)
 {
-    if (!input.matchSep(";") && !peekSemiAuto(input))
+    if (!input.matchSep(OP_SEMI) && !peekSemiAuto(input))
     {
-        throw new ParseError(
-            "expected semicolon or end of statement",
-            input.getPos()
-        );
+        fail(ERR_EXPECTED_SEMI, input.peek().ofs);
+        return false;
     }
+
+    return true;
 }
 
 /**
 Read an identifier token from the input
 */
-std::string readIdent(TokenStream& input)
+bool readIdent(TokenStream& input, std::string_view& name)
 {
     auto t = input.read();
 
-    if (t->type != Token::IDENT)
-        throw new ParseError("expected identifier", t->pos);
+    if (t.type != Token::IDENT)
+    {
+        fail(ERR_EXPECTED_IDENT, t.ofs);
+        return false;
+    }
 
-    return t->stringVal;
-    // XXX leak    delete t;
+    name = input.name(t);
+    return true;
 }
 
 /**
-Parse a source file
+Skip the shebang line at the beginning of a file, if there is one
 */
-ASTNode* parseFile(std::string fileName, char *src, bool isRuntime = false)
+bool skipShebang(StrStream& strStream)
 {
-    StrStream strStream(src, fileName);
+    if (!strStream.match("#!"))
+        return true;
 
-    // If there is a shebang line at the beginning of the file
-    if (strStream.match("#!"))
+    // Consume all characters until the end of line
+    for (;;)
     {
-        // Consume all characters until the end of line
-        for (;;)
-        {
-            auto ch = strStream.peekCh();
-
-            if (ch == '\r' || ch == '\n')
-            {
-                break;
-            }
+        auto ch = strStream.peekCh();
 
-            if (ch == '\0')
-            {
-                throw new ParseError(
-                    "end of input in shebang line",
-                    strStream.getPos()
-                );
-            }
+        if (ch == '\r' || ch == '\n')
+        {
+            break;
+        }
 
-            strStream.readCh();
+        if (strStream.atEnd())
+        {
+            fail(ERR_SHEBANG_EOF, strStream.index);
+            return false;
         }
+
+        strStream.readCh();
     }
 
+    return true;
+}
+
+/**
+Parse a source file. On a parse error, null is returned and the error is
+recorded in the error field.
+*/
+ASTNode* parseFile(std::string fileName, const char* src, bool isRuntime = false)
+{
+    error = ParseError();
+
+    StrStream strStream(src, fileName);
+    if (!skipShebang(strStream))
+        return nullptr;
+    TokenStream input(&strStream);
+
+    return parseProgram(input, isRuntime);
+}
+
+/**
+Parse a source file of a given length, followed by INPUT_PADDING zero bytes
+*/
+ASTNode* parseFile(std::string fileName, const char* src, size_t len, bool isRuntime = false)
+{
+    error = ParseError();
+
+    StrStream strStream(src, len, fileName);
+    if (!skipShebang(strStream))
+        return nullptr;
     TokenStream input(&strStream);
 
     return parseProgram(input, isRuntime);
 }
 
+#if defined(ALMOND_MMAP)
+/**
+Parse a source file read through a memory mapping. The mapping does not
+outlive the call, so the error is located before returning.
+*/
+ASTNode* parseFile(std::string path, bool isRuntime = false, MapFlags flags = MMAP_RELEASE_BEHIND)
+{
+    error = ParseError();
+
+    MappedFile mapping;
+    if (!mapping.open(path, flags))
+        return fail(ERR_CANNOT_OPEN, 0);
+
+    StrStream strStream(mapping, path);
+    ASTNode* program = nullptr;
+    if (skipShebang(strStream))
+    {
+        TokenStream input(&strStream);
+        program = parseProgram(input, isRuntime);
+    }
+
+    if (failed())
+        error.locate(strStream.str);
+
+    return program;
+}
+#endif
+
 /**
 Parse a source string
 */
-ASTNode* parseString(char* src, std::string fileName = "", bool isRuntime = false)
+ASTNode* parseString(const char* src, std::string fileName = "", bool isRuntime = false)
 {
+    error = ParseError();
+
     StrStream strStream(src, fileName);
     TokenStream input(&strStream);
 
     return parseProgram(input, isRuntime);
 }
 
+/**
+Parse a source string of a given length, followed by INPUT_PADDING zero
+bytes
+*/
+ASTNode* parseString(const char* src, size_t len, std::string fileName = "", bool isRuntime = false)
+{
+    error = ParseError();
+
+    StrStream strStream(src, len, fileName);
+    TokenStream input(&strStream);
+
+    return parseProgram(input, isRuntime);
+}
+
+/**
+Parse a source string from its pre-lexed tokens
+*/
+ASTNode* parseTokens(StrStream& strStream, const TokenArray& tokens, bool isRuntime = false)
+{
+    error = ParseError();
+
+    TokenStream input(&strStream, &tokens);
+
+    return parseProgram(input, isRuntime);
+}
+
 /**
 Parse a top-level program node
 */
 ASTNode* parseProgram(TokenStream& input, bool isRuntime)
 {
-    SrcPos* pos = input.getPos();
+    StrStream& strStream = *input.stream;
+    if (!strStream.validUtf8)
+    {
+        bool ascii;
+        const char* bad = findInvalidUtf8(strStream.str, strStream.str + strStream.strLen, ascii);
+        return fail(ERR_INVALID_UTF8, bad - strStream.str);
+    }
 
     ASTNode* program = Builder::makeToplevel();
 
     while (!input.eof())
     {
         ASTNode* stmt = parseStmt(input);
+        if (failed())
+            return nullptr;
         Builder::appendStatement(program, stmt);
     }
 
     return program;
 }
 
-class ScopeExit {
-  std::function<void ()> func;
-public:
-  ScopeExit(std::function<void ()> func_) : func(func_) {}
-  ~ScopeExit() { func(); }
-};
-
 /**
 Parse a statement
 */
 ASTNode* parseStmt(TokenStream& input)
 {
-    /// Test if this is a label statement and backtrack
-    auto isLabel = [](TokenStream& input)
-    {
-        // Copy the starting input to allow backtracking
-        TokenStream startInput(input);
-
-        // On return, backtrack to the start
-        ScopeExit([&]() {
-            input.backtrack(startInput);
-        });
-
-        auto t = input.peek();
-        if (t->type != Token::IDENT)
-            return false;
-        input.read();
+    return parseNested(input, STEP_STMT, 0);
+}
 
-        return input.matchSep(":");
-    };
+/**
+Parse an expression
+*/
+ASTNode* parseExpr(TokenStream& input, int minPrec = 0)
+{
+    return parseNested(input, STEP_EXPR, minPrec);
+}
 
-    // Get the current source position
-    SrcPos* pos = input.getPos();
+/**
+Parse an atomic expression: an operand with its prefix operators, but
+without the operators following it
+*/
+ASTNode* parseAtom(TokenStream& input)
+{
+    return parseNested(input, STEP_EXPR, MAX_PREC+1);
+}
 
-    // Empty statement
-    if (input.matchSep(";"))
-    {
-        return Builder::makeEmpty();
-    }
+/**
+Run the parsing steps until the statement or expression started by the
+first step is complete. The constructs whose parse is suspended while a
+nested statement or expression is parsed are kept on the frame stack, so
+that the nesting depth of the input is bounded by memory, not by the
+size of the thread stack.
+
+A step function may directly take the step following it, but only if it
+cannot be reached from that step, so that the native stack depth stays
+constant. This is why a complete argument list returns to this loop for
+its operators: a call may follow it.
+*/
+ASTNode* parseNested(TokenStream& input, ParseStep step, int minPrec)
+{
+    size_t base = frames.size();
+    ASTNode* node = nullptr;
 
-    // Block statement
-    else if (input.matchSep("{"))
+    for (;;)
     {
-        ASTNode* stmts = nullptr; // MAKE block
-
-        for (;;)
+        switch (step)
         {
-            if (input.matchSep("}"))
-                break;
-
-            if (input.eof())
-            {
-                throw new ParseError(
-                    "end of input in block statement",
-                    input.getPos()
-                );
-            }
-
-            Builder::appendStatement(stmts, parseStmt(input));
-        }
-
-        return stmts;
-    }
+            case STEP_STMT:
+            step = stmtStep(input, node, minPrec);
+            break;
 
-    // If statement
-    else if (input.matchKw("if"))
-    {
-        readSep(input, "(");
-        ASTNode* testExpr = parseExpr(input);
-        readSep(input, ")");
+            case STEP_EXPR:
+            step = atomStep(input, node, minPrec);
+            break;
 
-        auto trueStmt = parseStmt(input);
+            case STEP_EXPR_TAIL:
+            step = exprTailStep(input, node, minPrec);
+            break;
 
-        ASTNode* falseStmt;
-        if (input.matchKw("else"))
-            falseStmt = parseStmt(input);
-        else
-            falseStmt = nullptr;
+            case STEP_RESUME:
+            if (frames.size() == base)
+                return node;
+            step = resumeStep(input, node, minPrec);
+            break;
+        }
 
-        return Builder::makeIf(testExpr, trueStmt, falseStmt);
+        if (failed())
+        {
+            frames.resize(base);
+            return nullptr;
+        }
     }
+}
 
-    // While loop
-    else if (input.matchKw("while"))
-    {
-        readSep(input, "(");
-        auto testExpr = parseExpr(input);
-        readSep(input, ")");
-        auto bodyStmt = parseStmt(input);
+/**
+Suspend the parse of a construct in a new frame. The frame reference is
+only valid until the next frame is pushed.
+*/
+Frame& suspend(FrameKind kind, int minPrec = 0)
+{
+    frames.push_back(Frame());
+    Frame& frame = frames.back();
+    frame.kind = kind;
+    frame.minPrec = minPrec;
+    return frame;
+}
 
-        return Builder::makeWhile(testExpr, bodyStmt);
-    }
+/**
+Start parsing a statement
+*/
+ParseStep stmtStep(TokenStream& input, ASTNode*& node, int& minPrec)
+{
+    auto t = input.peek();
 
-    // Do-while loop
-    else if (input.matchKw("do"))
+    // Statements starting with a keyword are dispatched with a single
+    // switch on the keyword identifier
+    if (t.type == Token::KEYWORD)
     {
-        auto bodyStmt = parseStmt(input);
-        if (input.matchKw("while") == false)
-            throw new ParseError("expected while", input.getPos());
-        readSep(input, "(");
-        auto testExpr = parseExpr(input);
-        readSep(input, ")");
-
-        return Builder::makeDo(bodyStmt, testExpr);
-    }
+        switch (t.id)
+        {
+            // If statement
+            case KW_IF:
+            {
+                input.read();
+                if (!readSep(input, OP_LPAREN))
+                    return STEP_RESUME;
+                suspend(FRAME_IF_TEST);
+                minPrec = 0;
+                return STEP_EXPR;
+            }
 
-    // For or for-in loop
-    else if (input.peekKw("for"))
-    {
-        return parseForStmt(input);
-    }
+            // While loop
+            case KW_WHILE:
+            {
+                input.read();
+                if (!readSep(input, OP_LPAREN))
+                    return STEP_RESUME;
+                suspend(FRAME_WHILE_TEST);
+                minPrec = 0;
+                return STEP_EXPR;
+            }
 
-    // Switch statement
-    else if (input.matchKw("switch"))
-    {
-        readSep(input, "(");
-        auto switchExpr = parseExpr(input);
-        readSep(input, ")");
-        readSep(input, "{");
+            // Do-while loop
+            case KW_DO:
+            {
+                input.read();
+                suspend(FRAME_DO_BODY);
+                return STEP_STMT;
+            }
 
-        bool defaultSeen = false;
+            // For or for-in loop
+            case KW_FOR:
+            {
+                return forStep(input, minPrec);
+            }
 
-        printf("switch\n");
-        ASTNode* switch_ = Builder::makeSwitch(switchExpr);
+            // Switch statement
+            case KW_SWITCH:
+            {
+                input.read();
+                if (!readSep(input, OP_LPAREN))
+                    return STEP_RESUME;
+                suspend(FRAME_SWITCH_EXPR);
+                minPrec = 0;
+                return STEP_EXPR;
+            }
 
-        // For each case
-        for (;;)
-        {
-            if (input.matchSep("}"))
+            // Break statement
+            case KW_BREAK:
             {
-                break;
+                input.read();
+                std::string_view label;
+                if (!peekSemiAuto(input) && !readIdent(input, label))
+                    return STEP_RESUME;
+                if (!readSemiAuto(input))
+                    return STEP_RESUME;
+                node = Builder::makeBreak(label);
+                return STEP_RESUME;
             }
 
-            else if (input.matchKw("case"))
+            // Continue statement
+            case KW_CONTINUE:
             {
-                ASTNode* caseExpr = parseExpr(input);
-                readSep(input, ":");
+                input.read();
+                std::string_view label;
+                if (!peekSemiAuto(input) && !readIdent(input, label))
+                    return STEP_RESUME;
+                if (!readSemiAuto(input))
+                    return STEP_RESUME;
+                node = Builder::makeContinue(label);
+                return STEP_RESUME;
+            }
 
-                Builder::appendSwitchCase(switch_, caseExpr);
+            // Return statement
+            case KW_RETURN:
+            {
+                input.read();
+                if (input.matchSep(OP_SEMI) || peekSemiAuto(input))
+                {
+                    node = Builder::makeReturn(nullptr);
+                    return STEP_RESUME;
+                }
+
+                suspend(FRAME_RETURN);
+                minPrec = 0;
+                return STEP_EXPR;
             }
 
-            else if (input.matchKw("default"))
+            // Throw statement
+            case KW_THROW:
             {
-                readSep(input, ":");
-                if (defaultSeen)
-                    throw new ParseError("duplicate default label", input.getPos());
+                input.read();
+                suspend(FRAME_THROW);
+                minPrec = 0;
+                return STEP_EXPR;
+            }
 
-                defaultSeen = true;
-                Builder::appendSwitchDefault(switch_);
+            // Try-catch-finally statement
+            case KW_TRY:
+            {
+                input.read();
+                suspend(FRAME_TRY_BLOCK);
+                return STEP_STMT;
             }
 
-            else
+            // Variable declaration/initialization statement
+            case KW_VAR:
             {
-                ASTNode* statement = parseStmt(input);
-                Builder::appendSwitchStatement(switch_, statement);
+                input.read();
+                Frame& frame = suspend(FRAME_VAR_INIT);
+                frame.a = Builder::makeVars();
+                frame.flag = true;
+                return varStep(input, node, minPrec);
             }
-        }
 
-        return switch_;
-    }
+            // Function declaration statement
+            case KW_FUNCTION:
+            {
+                suspend(FRAME_FUNCTION_DECL);
+                minPrec = MAX_PREC+1;
+                return STEP_EXPR;
+            }
 
-    // Break statement
-    else if (input.matchKw("break"))
-    {
-        auto label = peekSemiAuto(input) ? nullptr : readIdent(input);
-        readSemiAuto(input);
-        return Builder::makeBreak(label);
+            // Other keywords start expression statements
+            default:
+                break;
+        }
     }
 
-    // Continue statement
-    else if (input.matchKw("continue"))
+    else if (t.type == Token::SEP)
     {
-        auto label = peekSemiAuto(input) ? nullptr : readIdent(input);
-        readSemiAuto(input);
-        return Builder::makeContinue(label);
-    }
+        switch (t.id)
+        {
+            // Empty statement
+            case OP_SEMI:
+            {
+                input.read();
+                node = Builder::makeEmpty();
+                return STEP_RESUME;
+            }
 
-    // Return statement
-    else if (input.matchKw("return"))
-    {
-        if (input.matchSep(";") || peekSemiAuto(input))
-            return Builder::makeReturn(nullptr);
+            // Block statement
+            case OP_LBRACE:
+            {
+                input.read();
+                Frame& frame = suspend(FRAME_BLOCK_STMT);
+                frame.a = nullptr; // MAKE block
+                return blockStep(input, node);
+            }
 
-        ASTNode* expr = parseExpr(input);
-        readSemiAuto(input);
-        return Builder::makeReturn(expr);
+            default:
+                break;
+        }
     }
 
-    // Throw statement
-    else if (input.matchKw("throw"))
+    // If this is a labelled statement, an identifier followed by a colon
+    else if (t.type == Token::IDENT && input.peek(1).type == Token::SEP && input.peek(1).id == OP_COLON)
     {
-        ASTNode* expr = parseExpr(input);
-        readSemiAuto(input);
-        return Builder::makeThrow(expr);
+        auto label = input.read();
+        assert(label.type == Token::IDENT);
+        if (!readSep(input, OP_COLON))
+            return STEP_RESUME;
+        Frame& frame = suspend(FRAME_LABEL);
+        frame.tok = label;
+        return STEP_STMT;
     }
 
-    // Try-catch-finally statement
-    else if (input.matchKw("try"))
+    // Parse as an expression statement, remembering the token at the
+    // start of the expression
+    Frame& frame = suspend(FRAME_EXPR_STMT);
+    frame.tok = t;
+    minPrec = 0;
+    return atomStep(input, node, minPrec);
+}
+
+/**
+Parse the next statement of a block statement, whose frame is on top of
+the stack
+*/
+ParseStep blockStep(TokenStream& input, ASTNode*& node)
+{
+    Frame& frame = frames.back();
+
+    if (input.matchSep(OP_RBRACE))
     {
-        auto tryStmt = parseStmt(input);
+        node = frame.a;
+        frames.pop_back();
+        return STEP_RESUME;
+    }
+
+    if (input.eof())
+    {
+        fail(ERR_BLOCK_EOF, input.peek().ofs);
+        return STEP_RESUME;
+    }
 
-        ASTNode* catchIdent = nullptr;
-        ASTNode* catchStmt = nullptr;
-        if (input.matchKw("catch"))
+    return STEP_STMT;
+}
+
+/**
+Parse the next declaration of a variable statement, whose frame is on top
+of the stack
+*/
+ParseStep varStep(TokenStream& input, ASTNode*& node, int& minPrec)
+{
+    Frame& frame = frames.back();
+
+    // For each declaration
+    for (;;)
+    {
+        // If this is not the first declaration and there is no comma
+        if (!frame.flag && input.matchSep(OP_COMMA) == false)
         {
-            readSep(input, "(");
-            catchIdent = parseExpr(input);
-            if (catchIdent == nullptr)
-                throw new ParseError("invalid catch identifier", input.getPos());
-            readSep(input, ")");
-            catchStmt = parseStmt(input);
+            if (!readSemiAuto(input))
+                return STEP_RESUME;
+            node = frame.a;
+            frames.pop_back();
+            return STEP_RESUME;
         }
 
-        ASTNode* finallyStmt = nullptr;
-        if (input.matchKw("finally"))
+        auto name = input.read();
+        if (name.type != Token::IDENT)
         {
-            finallyStmt = parseStmt(input);
+            fail(ERR_VAR_IDENT, name.ofs);
+            return STEP_RESUME;
         }
 
-        if (!catchStmt && !finallyStmt)
-            throw new ParseError("no catch or finally block", input.getPos());
+        frame.flag = false;
 
-        return Builder::makeTry(
-            tryStmt, 
-            catchIdent, 
-            catchStmt,
-            finallyStmt
-        );
-    }
+        // Parse the initialization expression, if present
+        if (input.matchOp(OP_ASSIGN))
+        {
+            frame.tok = name;
+            minPrec = COMMA_PREC+1;
+            return STEP_EXPR;
+        }
 
-    // Variable declaration/initialization statement
-    else if (input.matchKw("var"))
-    {
-        bool firstIdent = true;
+        Builder::appendVar(frame.a, input.name(name), nullptr);
+    }
+}
 
-        ASTNode* vars = Builder::makeVars();
+/**
+Parse the next case label or statement of a switch statement, whose
+frame is on top of the stack
+*/
+ParseStep switchStep(TokenStream& input, ASTNode*& node, int& minPrec)
+{
+    Frame& frame = frames.back();
 
-        // For each declaration
-        for (;;)
+    // For each case
+    for (;;)
+    {
+        if (input.matchSep(OP_RBRACE))
         {
-            // If this is not the first declaration and there is no comma
-            if (!firstIdent && input.matchSep(",") == false)
-            {
-                readSemiAuto(input);
-                break;
-            }
-
-            auto name = input.read();
-            if (name->type != Token::IDENT)
-            {
-                throw new ParseError(
-                    "expected identifier in variable declaration",
-                    name->pos
-                );
-            }
+            node = frame.a;
+            frames.pop_back();
+            return STEP_RESUME;
+        }
 
-            ASTNode* initExpr = nullptr;
-            auto op = input.peek();
+        else if (input.matchKw(KW_CASE))
+        {
+            frame.kind = FRAME_SWITCH_CASE;
+            minPrec = 0;
+            return STEP_EXPR;
+        }
 
-            if (op->type == Token::OP && op->stringVal == "=")
+        else if (input.matchKw(KW_DEFAULT))
+        {
+            if (!readSep(input, OP_COLON))
+                return STEP_RESUME;
+            if (frame.flag)
             {
-                input.read(); 
-                initExpr = parseExpr(input, COMMA_PREC+1);
+                fail(ERR_DUPLICATE_DEFAULT, input.peek().ofs);
+                return STEP_RESUME;
             }
 
-            Builder::appendVar(vars, name->stringVal.c_str(), initExpr);
-            firstIdent = false;
+            frame.flag = true;
+            Builder::appendSwitchDefault(frame.a);
         }
 
-        return vars;
+        else
+        {
+            frame.kind = FRAME_SWITCH_STMT;
+            return STEP_STMT;
+        }
     }
+}
 
-    // Function declaration statement
-    else if (input.peekKw("function"))
+/**
+Parse the finally clause of a try statement, whose frame is on top of the
+stack, or complete the statement if there is none
+*/
+ParseStep finallyStep(TokenStream& input, ASTNode*& node)
+{
+    Frame& frame = frames.back();
+
+    if (input.matchKw(KW_FINALLY))
     {
-        auto funExpr = parseAtom(input);
+        frame.kind = FRAME_FINALLY_BLOCK;
+        return STEP_STMT;
+    }
 
-        // Weed out trailing semicolons
-        if (input.peekSep(";"))
-            input.read();
+    return tryEndStep(input, node, nullptr);
+}
+
+/**
+Complete a try statement, whose frame is on top of the stack
+*/
+ParseStep tryEndStep(TokenStream& input, ASTNode*& node, ASTNode* finallyStmt)
+{
+    Frame& frame = frames.back();
 
-        return funExpr;
+    // Clauses are told apart by their keywords, as block statements may
+    // be built as null nodes
+    if (!frame.flag && frame.kind != FRAME_FINALLY_BLOCK)
+    {
+        fail(ERR_NO_CATCH_FINALLY, input.peek().ofs);
+        return STEP_RESUME;
     }
 
-    // If this is a labelled statement
-    else if (isLabel(input))
+    node = Builder::makeTry(
+        frame.a, 
+        frame.b, 
+        frame.c,
+        finallyStmt
+    );
+
+    frames.pop_back();
+    return STEP_RESUME;
+}
+
+/**
+Start parsing a for or for-in loop statement
+*/
+ParseStep forStep(TokenStream& input, int& minPrec)
+{
+    // Read the for keyword and the opening parenthesis
+    if (!readKw(input, KW_FOR) || !readSep(input, OP_LPAREN))
+        return STEP_RESUME;
+
+    // A declaration is a for-in loop if its name is followed by "in"
+    if (input.peekKw(KW_VAR))
     {
-        auto label = input.read();
-        assert(label->type == Token::IDENT);
-        readSep(input, ":");
-        auto stmt = parseStmt(input);
+        auto inTok = input.peek(2);
+        if (input.peek(1).type == Token::IDENT && inTok.type == Token::OP && inTok.id == OP_IN)
+        {
+            input.read();
+            suspend(FRAME_FOR_DECL);
+            minPrec = IN_PREC+1;
+            return STEP_EXPR;
+        }
+    }
 
-        return Builder::makeLabel(label->stringVal.c_str(), stmt);
+    // Parse the init statement. An expression is parsed once, up to an
+    // "in" operator, and either becomes the variable of a for-in loop
+    // or is continued as the init expression.
+    if (input.peekKw(KW_VAR) || input.peekSep(OP_SEMI))
+    {
+        suspend(FRAME_FOR_INIT_STMT);
+        return STEP_STMT;
     }
 
-    // Peek at the token at the start of the expression
-    auto startTok = input.peek();
+    suspend(FRAME_FOR_INIT_LHS);
+    minPrec = IN_PREC+1;
+    return STEP_EXPR;
+}
 
-    // Parse as an expression statement
-    ASTNode* expr = parseExpr(input);
+/**
+Parse the test expression of a for loop, whose frame is on top of the
+stack with the init statement
+*/
+ParseStep forTestStep(TokenStream& input, int& minPrec)
+{
+    // XXX TODO if (!Builder::isVar(initStmt) && !Builder::isExpression(initStmt))
+    //    invalid for-loop init statement
 
-    // Peek at the token after the expression
-    auto endTok = input.peek();
+    Frame& frame = frames.back();
 
-    // If the statement is empty
-    if (endTok == startTok)
+    if (input.matchSep(OP_SEMI))
     {
-        throw new ParseError(
-            "empty statements must be terminated by semicolons",
-            endTok->pos
-        );
+        frame.b = nullptr;
+        return forIncrStep(input, minPrec);
     }
 
-    // Read the terminating semicolon
-    readSemiAuto(input);
-
-    return expr;
+    frame.kind = FRAME_FOR_TEST;
+    minPrec = 0;
+    return STEP_EXPR;
 }
 
 /**
-Parse a for or for-in loop statement
+Parse the increment expression of a for loop, whose frame is on top of
+the stack
 */
-ASTNode* parseForStmt(TokenStream& input)
+ParseStep forIncrStep(TokenStream& input, int& minPrec)
 {
-    /// Test if this is a for-in statement and backtrack
-    auto isForIn = [&](TokenStream& input)
+    Frame& frame = frames.back();
+
+    if (input.matchSep(OP_RPAREN))
     {
-        // Copy the starting input to allow backtracking
-        TokenStream startInput(input);
+        frame.c = nullptr;
+        frame.kind = FRAME_FOR_BODY;
+        return STEP_STMT;
+    }
 
-        // On return, backtrack to the start
-        ScopeExit([&]() {
-            input.backtrack(startInput);
-        });
+    frame.kind = FRAME_FOR_INCR;
+    minPrec = 0;
+    return STEP_EXPR;
+}
 
-        // Test if there is a variable declaration
-        auto hasDecl = input.matchKw("var");
+/**
+Parse the rest of a for-in loop statement, from the "in" operator
+following the loop variable. The loop frame is on top of the stack.
+*/
+ParseStep forInStep(TokenStream& input, bool hasDecl, ASTNode* varExpr, int& minPrec)
+{
+    // XXX if (hasDecl && !Builder::isName(varExpr)) // XXX
+    //    invalid variable expression in for-in loop
 
-        if (input.peekSep(";"))
-            return false;
+    if (!input.matchOp(OP_IN))
+    {
+        fail(ERR_EXPECTED_IN, input.peek().ofs);
+        return STEP_RESUME;
+    }
 
-        // Parse the first expression, stop at comma if there is a declaration
-        auto firstExpr = parseExpr(input, hasDecl ? (COMMA_PREC+1) : COMMA_PREC);
+    Frame& frame = frames.back();
+    frame.kind = FRAME_FOR_IN_EXPR;
+    frame.flag = hasDecl;
+    frame.a = varExpr;
+    minPrec = 0;
+    return STEP_EXPR;
+}
 
-        if (input.peekSep(";"))
-            return false;
+/**
+Start parsing an expression with its first operand
+*/
+ParseStep atomStep(TokenStream& input, ASTNode*& node, int& minPrec)
+{
+    auto t = input.peek();
 
-        if (Builder::isBinary(firstExpr, "in"))
-            return true;
+    switch (t.type)
+    {
+        // End of file
+        case Token::EOFF:
+        fail(ERR_EXPR_EOF, t.ofs);
+        return STEP_RESUME;
 
-        return false;
-    };
+        // Identifier/symbol literal
+        case Token::IDENT:
+        input.read();
+        node = Builder::makeName(input.name(t));
+        return exprTailStep(input, node, minPrec);
 
-    // Get the current position
-    auto pos = input.getPos();
+        // Integer literal
+        case Token::INT:
+        input.read();
+        node = Builder::makeNum(t.intVal);
+        return exprTailStep(input, node, minPrec);
 
-    // Read the for keyword and the opening parenthesis
-    readKw(input, "for");
-    readSep(input, "(");
+        // Floating-point literal
+        case Token::FLOAT:
+        input.read();
+        node = Builder::makeNum(t.floatVal);
+        return exprTailStep(input, node, minPrec);
 
-    // If this is a regular for-loop statement
-    if (isForIn(input) == false)
-    {
-        // Parse the init statement
-        auto initStmt = parseStmt(input);
-        // XXX TODO if (!Builder::isVar(initStmt) && !Builder::isExpression(initStmt))
-        //    throw new ParseError("invalid for-loop init statement", initStmt.pos);
-
-        // Parse the test expression
-        pos = input.getPos();
-        ASTNode* testExpr;
-        if (input.matchSep(";"))
-        {
-            testExpr = nullptr;
-        }
-        else
+        // String literal
+        case Token::STRING:
+        input.read();
+        node = Builder::makeString(input.stringLit(t));
+        return exprTailStep(input, node, minPrec);
+
+        // Regular expression literal
+        case Token::REGEXP:
         {
-            testExpr = parseExpr(input);
-            readSep(input, ";");
+            assert(0);
+            /*
+            input.read();
+            return new RegexpExpr(t.regexpVal, t.flagsVal, pos);
+            */
+            break;
         }
 
-        // Parse the inccrement expression
-        pos = input.getPos();
-        ASTNode* incrExpr;
-        if (input.matchSep(")"))
+        case Token::SEP:
+        switch (t.id)
         {
-            incrExpr = nullptr;
+            // Parenthesized expression
+            case OP_LPAREN:
+            {
+                input.read();
+                suspend(FRAME_PAREN, minPrec);
+                minPrec = 0;
+                return STEP_EXPR;
+            }
+
+            // Array literal
+            case OP_LBRACKET:
+            {
+                input.read();
+                Frame& frame = suspend(FRAME_ARRAY_ELEMS, minPrec);
+                frame.b = Builder::makeList();
+                return listStep(input, node, minPrec);
+            }
+
+            // Object literal
+            case OP_LBRACE:
+            {
+                input.read();
+                assert(0);
+                /*
+                StringExpr[] names = [];
+                ASTNode*[] values = [];
+
+                // For each property
+                for (;;)
+                {
+                    // If this is the end of the literal, stop
+                    if (input.matchSep(OP_RBRACE))
+                        break;
+
+                    // Read a property name
+                    auto tok = input.read();
+                    StringExpr stringExpr = null;
+                    if (tok.type is Token::IDENT ||
+                        tok.type is Token::KEYWORD ||
+                        tok.type is Token::STRING)
+                        stringExpr = new StringExpr(tok.stringVal, tok.pos);
+                    if (tok.type is Token::OP && ident(tok.stringVal))
+                        stringExpr = new StringExpr(tok.stringVal, tok.pos);
+                    else if (tok.type is Token::INT)
+                        stringExpr = new StringExpr(to!std::string(tok.intVal), tok.pos);
+
+                    if (!stringExpr)
+                        throw new ParseError("expected property name in object literal", tok.pos);
+                    names ~= [stringExpr];
+
+                    readSep(input, OP_COLON);
+
+                    // Parse an expression with priority above the comma operator
+                    auto valueExpr = parseExpr(input, COMMA_PREC+1);
+                    values ~= [valueExpr];
+
+                    // If there is no separating comma
+                    if (!input.matchSep(OP_COMMA))
+                    {
+                        // If this is the end of the literal, stop
+                        if (input.matchSep(OP_RBRACE))
+                            break;
+
+                        // Comma expected before next property
+                        throw new ParseError("expected comma in object literal", input.getPos());
+                    }
+                }
+
+                return new ObjectExpr(names, values, pos);
+                */
+                break;
+            }
         }
-        else
+        break;
+
+        case Token::KEYWORD:
+        switch (t.id)
         {
-            incrExpr = parseExpr(input);
-            readSep(input, ")");
-        }
+            // Function expression
+            // function (params) body
+            case KW_FUNCTION:
+            {
+                input.read();
+
+                // Read the function name, if present
+                auto name = input.peek();
+                bool hasName = name.type == Token::IDENT;
+                if (hasName)
+                    input.read();
+
+                auto params = parseParamList(input);
+                if (failed())
+                    return STEP_RESUME;
+
+                Frame& frame = suspend(FRAME_FUNCTION_BODY, minPrec);
+                frame.flag = hasName;
+                frame.tok = name;
+                frame.a = params;
+                return STEP_STMT;
+            }
 
-        // Parse the loop body
-        auto bodyStmt = parseStmt(input);
+            // True boolean constant
+            case KW_TRUE:
+            input.read();
+            node = Builder::makeBool(true);
+            return exprTailStep(input, node, minPrec);
 
-        return Builder::makeFor(initStmt, testExpr, incrExpr, bodyStmt);
-    }
+            // False boolean constant
+            case KW_FALSE:
+            input.read();
+            node = Builder::makeBool(false);
+            return exprTailStep(input, node, minPrec);
 
-    // This is a for-in statement
-    else
-    {
-        auto hasDecl = input.matchKw("var");
-        auto varExpr = parseExpr(input, IN_PREC+1);
-        // XXX if (hasDecl && !Builder::isName(varExpr)) // XXX
-        //    throw new ParseError("invalid variable expression in for-in loop", pos);
-
-        auto inTok = input.peek();
-        if (inTok->type != Token::OP || inTok->stringVal != "in")
-            throw new ParseError("expected \"in\" keyword", input.getPos());
-        input.read();
+            // Null constant
+            case KW_NULL:
+            input.read();
+            node = Builder::makeNull();
+            return exprTailStep(input, node, minPrec);
+        }
+        break;
 
-        auto inExpr = parseExpr(input);
+        // New expression
+        case Token::OP:
+        if (t.id == OP_NEW)
+        {
+            // Consume the "new" token
+            input.read();
+
+            // Parse the base expression
+            suspend(FRAME_NEW_BASE, minPrec);
+            minPrec = opRules[OP_NEW].prefixPrec;
+            return STEP_EXPR;
+        }
+
+        // Unary expressions
+        else
+        {
+            int prec = opRules[t.id].prefixPrec;
+            if (prec < 0)
+            {
+                fail(ERR_UNARY_OP, t.ofs, opStrings[t.id]);
+                return STEP_RESUME;
+            }
 
-        readSep(input, ")");
+            // Consume the operator
+            input.read();
 
-        // Parse the loop body
-        auto bodyStmt = parseStmt(input);
+            // Parse the right subexpression
+            Frame& frame = suspend(FRAME_PREFIX, minPrec);
+            frame.op = (OpId)t.id;
+            minPrec = prec;
+            return STEP_EXPR;
+        }
 
-        return Builder::makeForIn(hasDecl, varExpr, inExpr, bodyStmt);
+        default:
+        break;
     }
+
+    fail(ERR_UNEXPECTED_TOKEN, t.ofs, (t.type == Token::ERROR)? t.errorMsg:nullptr);
+    return STEP_RESUME;
 }
 
 /**
-Parse an expression
+Parse the operators following a complete operand, with the precedence
+climbing algorithm:
+
+If an operator has less than the current minimum precedence, the loop
+breaks, returning to the suspended construct, which will attach the
+operand to the previous operator (on the right)
+
+If an operator has the minimum precedence or greater, it associates the
+operand to its left, and its right operand is parsed with a minimum
+precedence above its own (or equal to it, if right-associative)
 */
-ASTNode* parseExpr(TokenStream& input, int minPrec = 0)
+ParseStep exprTailStep(TokenStream& input, ASTNode*& lhsExpr, int& minPrec)
 {
-    // Expression parsing using the precedence climbing algorithm
-    //    
-    // The first call has min precedence 0
-    //
-    // Each call loops to grab everything of the current precedence or
-    // greater and builds a left-sided subtree out of it, associating
-    // operators to their left operand
-    //
-    // If an operator has less than the current precedence, the loop
-    // breaks, returning us to the previous loop level, this will attach
-    // the atom to the previous operator (on the right)
-    //
-    // If an operator has the mininum precedence or greater, it will
-    // associate the current atom to its left and then parse the rhs
-
-    // Parse the first atom
-    ASTNode* lhsExpr = parseAtom(input);
-
     for (;;)
     {
         // Peek at the current token
         auto cur = input.peek();
 
         // If the token is not an operator or separator, break out
-        if (cur->type != Token::OP && cur->type != Token::SEP)
+        if (cur.type != Token::OP && cur.type != Token::SEP)
             break;
 
-        //writefln("op str: %s", cur->stringVal);
-
-        // Attempt to find a corresponding operator
-        auto op = findOperator(cur->stringVal, 2);
-        if (!op)
-            op = findOperator(cur->stringVal, 1, 'l');
-        if (!op && cur->stringVal == "?")
-            op = findOperator(cur->stringVal, 3);
-
-        // If no operator matches, break out
-        if (!op)
+        // If the token has no infix or postfix form, break out
+        const OpRule& rule = opRules[cur.id];
+        if (rule.infix == INFIX_NONE)
             break;
 
         // If the new operator has lower precedence, break out
-        if (op->prec < minPrec)
+        if (rule.prec < minPrec)
             break;
 
-        // Compute the minimal precedence for the recursive call (if any)
-        int nextMinPrec = (op->assoc == 'l') ? (op->prec + 1) : op->prec;
+        // Compute the minimal precedence for the right operand (if any)
+        int nextMinPrec = rule.rightAssoc ? rule.prec : (rule.prec + 1);
 
-        // If this is a function call expression
-        if (cur->stringVal == "(")
+        switch (rule.infix)
         {
-            // Parse the argument list and create the call expression
-            auto argExprs = parseExprList(input, "(", ")");
-            lhsExpr = Builder::makeCall(lhsExpr, argExprs); // lhsExpr.pos);
+            // Function call expression
+            case INFIX_CALL:
+            {
+                // Parse the argument list and create the call expression
+                input.read();
+                Frame& frame = suspend(FRAME_CALL_ARGS, minPrec);
+                frame.a = lhsExpr;
+                frame.b = Builder::makeList();
+                return listStep(input, lhsExpr, minPrec);
+            }
+
+            // Array indexing expression
+            case INFIX_INDEX:
+            {
+                input.read();
+                Frame& frame = suspend(FRAME_INDEX, minPrec);
+                frame.a = lhsExpr;
+                minPrec = 0;
+                return STEP_EXPR;
+            }
+
+            // Member expression
+            case INFIX_MEMBER:
+            {
+                input.read();
+
+                // Parse the identifier string
+                auto tok = input.read();
+                if (!(tok.type == Token::IDENT) &&
+                    !(tok.type == Token::KEYWORD) &&
+                    !(tok.type == Token::OP && isWordOpId(tok.id)))
+                {
+                    fail(ERR_MEMBER_IDENT, tok.ofs);
+                    return STEP_RESUME;
+                }
+
+                // Produce an indexing expression
+                std::string_view name = (tok.type == Token::IDENT) ? std::string_view(input.name(tok)) : input.text(tok);
+                lhsExpr = Builder::makeIndex(lhsExpr, name); //, lhsExpr.pos);
+                break;
+            }
+
+            // Ternary conditional operator
+            case INFIX_TERNARY:
+            {
+                // Consume the current token
+                input.read();
+
+                Frame& frame = suspend(FRAME_TERNARY_TRUE, minPrec);
+                frame.a = lhsExpr;
+                minPrec = 0;
+                return STEP_EXPR;
+            }
+
+            // Binary operator, including compound assignments
+            case INFIX_BINARY:
+            case INFIX_COMPOUND_ASSIGN:
+            {
+                // Consume the current token
+                input.read();
+
+                // Parse the rhs
+                Frame& frame = suspend((rule.infix == INFIX_BINARY)? FRAME_BINARY:FRAME_COMPOUND_ASSIGN, minPrec);
+                frame.op = (OpId)cur.id;
+                frame.a = lhsExpr;
+                minPrec = nextMinPrec;
+                return STEP_EXPR;
+            }
+
+            // Postfix unary operator
+            case INFIX_POSTFIX:
+            {
+                // Consume the current token
+                input.read();
+
+                // Update lhs with the new value
+                lhsExpr = Builder::makeUnary((OpId)cur.id, lhsExpr); //, lhsExpr.pos);
+                break;
+            }
+
+            default:
+            assert (false); // "unhandled operator");
         }
+    }
+
+    // Return the parsed expression
+    return STEP_RESUME;
+}
+
+/**
+Parse the next element of an argument list or array literal, whose frame
+is on top of the stack. At the closing separator, the list is complete.
+*/
+ParseStep listStep(TokenStream& input, ASTNode*& node, int& minPrec)
+{
+    Frame& frame = frames.back();
+    bool isArray = frame.kind == FRAME_ARRAY_ELEMS;
+    OpId closeSep = isArray? OP_RBRACKET:OP_RPAREN;
+
+    for (;;)
+    {
+        if (input.matchSep(closeSep))
+            break;
 
-        // If this is an array indexing expression
-        else if (input.matchSep("["))
+        // If this is not the first element and there
+        // is no comma separator, this is an error
+        if (frame.flag && input.matchSep(OP_COMMA) == false)
         {
-            auto indexExpr = parseExpr(input);
-            readSep(input, "]");
-            lhsExpr = Builder::makeSub(lhsExpr, indexExpr); //, lhsExpr.pos);
+            fail(ERR_EXPECTED_COMMA, input.peek().ofs);
+            return STEP_RESUME;
         }
 
-        // If this is a member expression
-        else if (op->str == ".")
+        // Handle missing array element syntax
+        if (isArray)
         {
-            input.read();
+            if (input.matchSep(closeSep))
+                break;
 
-            // Parse the identifier string
-            auto tok = input.read();
-            if (!(tok->type == Token::IDENT) &&
-                !(tok->type == Token::KEYWORD) &&
-                !(tok->type == Token::OP && ident(tok->stringVal.c_str())))
+            if (input.peekSep(OP_COMMA)) 
             {
-                throw new ParseError(
-                    "invalid member identifier \"" + tok->toString() + "\"", 
-                    tok->pos
-                );
+                Builder::append(frame.b, Builder::makeUndefined());
+                frame.flag = true;
+                continue;
             }
-
-            // Produce an indexing expression
-            lhsExpr = Builder::makeIndex(lhsExpr, tok->stringVal); //, lhsExpr.pos);
         }
 
-        // If this is the ternary conditional operator
-        else if (cur->stringVal == "?")
+        // Parse the current element
+        minPrec = COMMA_PREC+1;
+        return STEP_EXPR;
+    }
+
+    switch (frame.kind)
+    {
+        case FRAME_CALL_ARGS:
+        node = Builder::makeCall(frame.a, frame.b); // lhsExpr.pos);
+        break;
+
+        case FRAME_NEW_ARGS:
+        node = Builder::makeNew(frame.a, frame.b);
+        break;
+
+        default:
+        node = Builder::makeArray(frame.b);
+        break;
+    }
+
+    minPrec = frame.minPrec;
+    frames.pop_back();
+    return STEP_EXPR_TAIL;
+}
+
+/**
+Resume the parse of the construct on top of the frame stack, now that the
+nested statement or expression it was waiting for is complete
+*/
+ParseStep resumeStep(TokenStream& input, ASTNode*& node, int& minPrec)
+{
+    Frame& frame = frames.back();
+
+    switch (frame.kind)
+    {
+        case FRAME_IF_TEST:
+        if (!readSep(input, OP_RPAREN))
+            return STEP_RESUME;
+        frame.a = node;
+        frame.kind = FRAME_IF_TRUE;
+        return STEP_STMT;
+
+        case FRAME_IF_TRUE:
+        frame.b = node;
+        if (input.matchKw(KW_ELSE))
         {
-            // Consume the current token
-            input.read();
+            frame.kind = FRAME_IF_FALSE;
+            return STEP_STMT;
+        }
+        node = Builder::makeIf(frame.a, frame.b, nullptr);
+        break;
+
+        case FRAME_IF_FALSE:
+        node = Builder::makeIf(frame.a, frame.b, node);
+        break;
+
+        case FRAME_WHILE_TEST:
+        if (!readSep(input, OP_RPAREN))
+            return STEP_RESUME;
+        frame.a = node;
+        frame.kind = FRAME_WHILE_BODY;
+        return STEP_STMT;
+
+        case FRAME_WHILE_BODY:
+        node = Builder::makeWhile(frame.a, node);
+        break;
+
+        case FRAME_DO_BODY:
+        if (!readKw(input, KW_WHILE) || !readSep(input, OP_LPAREN))
+            return STEP_RESUME;
+        frame.a = node;
+        frame.kind = FRAME_DO_TEST;
+        minPrec = 0;
+        return STEP_EXPR;
+
+        case FRAME_DO_TEST:
+        if (!readSep(input, OP_RPAREN))
+            return STEP_RESUME;
+        node = Builder::makeDo(frame.a, node);
+        break;
+
+        case FRAME_FOR_DECL:
+        return forInStep(input, true, node, minPrec);
+
+        case FRAME_FOR_INIT_STMT:
+        frame.a = node;
+        return forTestStep(input, minPrec);
+
+        case FRAME_FOR_INIT_LHS:
+        if (input.peekOp(OP_IN))
+            return forInStep(input, false, node, minPrec);
+
+        // Continue the init expression past the "in" precedence level
+        frame.kind = FRAME_FOR_INIT_EXPR;
+        minPrec = 0;
+        return STEP_EXPR_TAIL;
+
+        case FRAME_FOR_INIT_EXPR:
+        if (!readSemiAuto(input))
+            return STEP_RESUME;
+        frame.a = node;
+        return forTestStep(input, minPrec);
+
+        case FRAME_FOR_TEST:
+        if (!readSep(input, OP_SEMI))
+            return STEP_RESUME;
+        frame.b = node;
+        return forIncrStep(input, minPrec);
+
+        case FRAME_FOR_INCR:
+        if (!readSep(input, OP_RPAREN))
+            return STEP_RESUME;
+        frame.c = node;
+        frame.kind = FRAME_FOR_BODY;
+        return STEP_STMT;
+
+        case FRAME_FOR_BODY:
+        node = Builder::makeFor(frame.a, frame.b, frame.c, node);
+        break;
+
+        case FRAME_FOR_IN_EXPR:
+        if (!readSep(input, OP_RPAREN))
+            return STEP_RESUME;
+        frame.b = node;
+        frame.kind = FRAME_FOR_IN_BODY;
+        return STEP_STMT;
+
+        case FRAME_FOR_IN_BODY:
+        node = Builder::makeForIn(frame.flag, frame.a, frame.b, node);
+        break;
+
+        case FRAME_SWITCH_EXPR:
+        if (!readSep(input, OP_RPAREN) || !readSep(input, OP_LBRACE))
+            return STEP_RESUME;
+        frame.a = Builder::makeSwitch(node);
+        frame.flag = false;
+        return switchStep(input, node, minPrec);
+
+        case FRAME_SWITCH_CASE:
+        if (!readSep(input, OP_COLON))
+            return STEP_RESUME;
+        Builder::appendSwitchCase(frame.a, node);
+        return switchStep(input, node, minPrec);
+
+        case FRAME_SWITCH_STMT:
+        Builder::appendSwitchStatement(frame.a, node);
+        return switchStep(input, node, minPrec);
+
+        case FRAME_RETURN:
+        if (!readSemiAuto(input))
+            return STEP_RESUME;
+        node = Builder::makeReturn(node);
+        break;
+
+        case FRAME_THROW:
+        if (!readSemiAuto(input))
+            return STEP_RESUME;
+        node = Builder::makeThrow(node);
+        break;
+
+        case FRAME_TRY_BLOCK:
+        frame.a = node;
+        if (input.matchKw(KW_CATCH))
+        {
+            if (!readSep(input, OP_LPAREN))
+                return STEP_RESUME;
+
+            // The catch parameter is an identifier, read without parsing
+            // an expression
+            auto t = input.read();
+            if (t.type == Token::EOFF)
+            {
+                fail(ERR_EXPR_EOF, t.ofs);
+                return STEP_RESUME;
+            }
+            if (t.type == Token::ERROR)
+            {
+                fail(ERR_UNEXPECTED_TOKEN, t.ofs, t.errorMsg);
+                return STEP_RESUME;
+            }
+            if (t.type != Token::IDENT)
+            {
+                fail(ERR_INVALID_CATCH, t.ofs);
+                return STEP_RESUME;
+            }
 
-            auto trueExpr = parseExpr(input);
-            readSep(input, ":");
-            auto falseExpr = parseExpr(input, op->prec-1);
+            if (!readSep(input, OP_RPAREN))
+                return STEP_RESUME;
 
-            lhsExpr = Builder::makeConditional(lhsExpr, trueExpr, falseExpr); //, lhsExpr.pos);
+            frame.b = Builder::makeName(input.name(t));
+            frame.flag = true;
+            frame.kind = FRAME_CATCH_BLOCK;
+            return STEP_STMT;
         }
+        return finallyStep(input, node);
 
-        // If this is a binary operator
-        else if (op->arity == 2)
-        {
-            // Consume the current token
+        case FRAME_CATCH_BLOCK:
+        frame.c = node;
+        return finallyStep(input, node);
+
+        case FRAME_FINALLY_BLOCK:
+        return tryEndStep(input, node, node);
+
+        case FRAME_VAR_INIT:
+        Builder::appendVar(frame.a, input.name(frame.tok), node);
+        return varStep(input, node, minPrec);
+
+        case FRAME_FUNCTION_DECL:
+        // Weed out trailing semicolons
+        if (input.peekSep(OP_SEMI))
             input.read();
+        break;
+
+        case FRAME_BLOCK_STMT:
+        Builder::appendStatement(frame.a, node);
+        return blockStep(input, node);
 
-            // Recursively parse the rhs
-            ASTNode* rhsExpr = parseExpr(input, nextMinPrec);
+        case FRAME_LABEL:
+        node = Builder::makeLabel(input.name(frame.tok), node);
+        break;
 
-            // Convert expressions of the form "x <op>= y" to "x = x <op> y" // XXX
-            auto eqOp = findOperator("=", 2, 'r');
-            if (op->str.size() >= 2 && op->str.back() == '=' && op->prec == eqOp->prec)
+        case FRAME_EXPR_STMT:
+        {
+            // If the statement is empty
+            auto endTok = input.peek();
+            if (endTok == frame.tok)
             {
-                auto rhsOp = findOperator(op->str.substr(0, op->str.size()-1), 2);
-                assert (rhsOp != nullptr);
-                rhsExpr = Builder::makeBinary(rhsOp->str, lhsExpr, rhsExpr); //, rhsExpr->pos);
-                op = eqOp;
+                fail(ERR_EMPTY_STMT, endTok.ofs);
+                return STEP_RESUME;
             }
 
-            // Update lhs with the new value
-            lhsExpr = Builder::makeBinary(op->str, lhsExpr, rhsExpr); //, lhsExpr.pos);
+            // Read the terminating semicolon
+            if (!readSemiAuto(input))
+                return STEP_RESUME;
+            break;
         }
 
-        // If this is a unary operator
-        else if (op->arity == 1)
-        {
-            // Consume the current token
-            input.read();
+        case FRAME_PAREN:
+        if (!readSep(input, OP_RPAREN))
+            return STEP_RESUME;
+        minPrec = frame.minPrec;
+        frames.pop_back();
+        return exprTailStep(input, node, minPrec);
 
-            // Update lhs with the new value
-            lhsExpr = Builder::makeUnary(op->str, lhsExpr); //, lhsExpr.pos);
-        }
+        case FRAME_PREFIX:
+        node = Builder::makeUnary(frame.op, node);
+        minPrec = frame.minPrec;
+        frames.pop_back();
+        return exprTailStep(input, node, minPrec);
 
-        else
+        case FRAME_NEW_BASE:
+        // Parse the argument list (if present, otherwise assumed empty)
+        if (input.matchSep(OP_LPAREN))
         {
-            assert (false); // "unhandled operator");
+            frame.kind = FRAME_NEW_ARGS;
+            frame.a = node;
+            frame.b = Builder::makeList();
+            return listStep(input, node, minPrec);
+        }
+        node = Builder::makeNew(node, nullptr);
+        minPrec = frame.minPrec;
+        frames.pop_back();
+        return exprTailStep(input, node, minPrec);
+
+        case FRAME_CALL_ARGS:
+        case FRAME_NEW_ARGS:
+        case FRAME_ARRAY_ELEMS:
+        Builder::append(frame.b, node);
+        frame.flag = true;
+        return listStep(input, node, minPrec);
+
+        case FRAME_INDEX:
+        if (!readSep(input, OP_RBRACKET))
+            return STEP_RESUME;
+        node = Builder::makeSub(frame.a, node); //, lhsExpr.pos);
+        minPrec = frame.minPrec;
+        frames.pop_back();
+        return exprTailStep(input, node, minPrec);
+
+        case FRAME_TERNARY_TRUE:
+        if (!readSep(input, OP_COLON))
+            return STEP_RESUME;
+        frame.b = node;
+        frame.kind = FRAME_TERNARY_FALSE;
+        minPrec = opRules[OP_QUESTION].prec - 1;
+        return STEP_EXPR;
+
+        case FRAME_TERNARY_FALSE:
+        node = Builder::makeConditional(frame.a, frame.b, node); //, lhsExpr.pos);
+        minPrec = frame.minPrec;
+        frames.pop_back();
+        return exprTailStep(input, node, minPrec);
+
+        case FRAME_BINARY:
+        node = Builder::makeBinary(frame.op, frame.a, node); //, lhsExpr.pos);
+        minPrec = frame.minPrec;
+        frames.pop_back();
+        return exprTailStep(input, node, minPrec);
+
+        // Convert expressions of the form "x <op>= y" to "x = x <op> y" // XXX
+        case FRAME_COMPOUND_ASSIGN:
+        node = Builder::makeBinary(opRules[frame.op].baseOp, frame.a, node); //, rhsExpr->pos);
+        node = Builder::makeBinary(OP_ASSIGN, frame.a, node); //, lhsExpr.pos);
+        minPrec = frame.minPrec;
+        frames.pop_back();
+        return exprTailStep(input, node, minPrec);
+
+        case FRAME_FUNCTION_BODY:
+        {
+            std::string_view name = frame.flag? std::string_view(input.name(frame.tok)):std::string_view();
+            node = Builder::makeFunction(name, frame.a, node);
+            minPrec = frame.minPrec;
+            frames.pop_back();
+            return exprTailStep(input, node, minPrec);
         }
     }
 
-    // Return the parsed expression
-    return lhsExpr;
+    // The statement is complete
+    frames.pop_back();
+    return STEP_RESUME;
 }
 
 /**
-Parse an atomic expression
+Parse a function declaration's parameter list
 */
-ASTNode* parseAtom(TokenStream& input)
+ASTNode* parseParamList(TokenStream& input)
 {
-    auto t = input.peek(LEX_MAYBE_RE);
-    SrcPos* pos = t->pos;
+    if (!readSep(input, OP_LPAREN))
+        return nullptr;
 
-    // End of file
-    if (input.eof())
-    {
-        throw new ParseError("end of input inside expression", pos);
-    }
+    ASTNode* exprs = Builder::makeList();
+    bool hasParams = false;
 
-    // Parenthesized expression
-    else if (input.matchSep("("))
+    for (;;)
     {
-        ASTNode* expr = parseExpr(input);
-        readSep(input, ")");
-        return expr;
-    }
+        if (input.matchSep(OP_RPAREN))
+            break;
 
-    // Array literal
-    else if (t->type == Token::SEP && t->stringVal == "[")
-    {
-        auto exprs = parseExprList(input, "[", "]");
-        return Builder::makeArray(exprs);
-    }
+        if (hasParams && input.matchSep(OP_COMMA) == false)
+            return fail(ERR_EXPECTED_COMMA, input.peek().ofs);
 
-    // Object literal
-    else if (input.matchSep("{"))
-    {
-        assert(0);
-        /*
-        StringExpr[] names = [];
-        ASTNode*[] values = [];
+        // Parameters are identifiers, read without parsing an expression
+        auto t = input.read();
+        if (t.type == Token::EOFF)
+            return fail(ERR_EXPR_EOF, t.ofs);
+        if (t.type == Token::ERROR)
+            return fail(ERR_UNEXPECTED_TOKEN, t.ofs, t.errorMsg);
+        if (t.type != Token::IDENT)
+            return fail(ERR_INVALID_PARAM, t.ofs);
 
-        // For each property
-        for (;;)
-        {
-            // If this is the end of the literal, stop
-            if (input.matchSep("}"))
-                break;
+        auto expr = Builder::makeName(input.name(t));
+        if (!Builder::isName(expr))
+            return fail(ERR_INVALID_PARAM, input.peek().ofs);
 
-            // Read a property name
-            auto tok = input.read();
-            StringExpr stringExpr = null;
-            if (tok.type is Token::IDENT ||
-                tok.type is Token::KEYWORD ||
-                tok.type is Token::STRING)
-                stringExpr = new StringExpr(tok.stringVal, tok.pos);
-            if (tok.type is Token::OP && ident(tok.stringVal))
-                stringExpr = new StringExpr(tok.stringVal, tok.pos);
-            else if (tok.type is Token::INT)
-                stringExpr = new StringExpr(to!std::string(tok.intVal), tok.pos);
-
-            if (!stringExpr)
-                throw new ParseError("expected property name in object literal", tok.pos);
-            names ~= [stringExpr];
-
-            readSep(input, ":");
-
-            // Parse an expression with priority above the comma operator
-            auto valueExpr = parseExpr(input, COMMA_PREC+1);
-            values ~= [valueExpr];
-
-            // If there is no separating comma
-            if (!input.matchSep(","))
-            {
-                // If this is the end of the literal, stop
-                if (input.matchSep("}"))
-                    break;
+        Builder::append(exprs, expr);
+        hasParams = true;
+    }
 
-                // Comma expected before next property
-                throw new ParseError("expected comma in object literal", input.getPos());
-            }
-        }
+    return exprs;
+}
 
-        return new ObjectExpr(names, values, pos);
-        */
-    }
+}; // struct Parser
+
+/**
+Builder which discards the nodes, used to find where statements end
+before they are built. All the nodes are the same placeholder, so that
+no node is null.
+*/
+struct DiscardNode {};
+
+struct DiscardBuilder
+{
+    static const int BUILDER_VERSION = 2;
 
-    // Regular expression literal
-    else if (t->type == Token::REGEXP)
+    static DiscardNode* node()
     {
-        assert(0);
-        /*
-        input.read();
-        return new RegexpExpr(t.regexpVal, t.flagsVal, pos);
-        */
+        static DiscardNode placeholder;
+        return &placeholder;
     }
 
-    // New expression
-    else if (t->type == Token::OP && t->stringVal == "new")
-    {
-        // Consume the "new" token
-        input.read();
+    static DiscardNode* makeToplevel() { return node(); }
+    static void appendStatement(DiscardNode*, DiscardNode*) {}
+    static DiscardNode* makeEmpty() { return node(); }
+    static DiscardNode* makeList() { return node(); }
+    static void append(DiscardNode*, DiscardNode*) {}
+    static DiscardNode* makeIf(DiscardNode*, DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeUndefined() { return node(); }
+    static DiscardNode* makeNull() { return node(); }
+    static DiscardNode* makeWhile(DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeDo(DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeFor(DiscardNode*, DiscardNode*, DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeForIn(bool, DiscardNode*, DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeSwitch(DiscardNode*) { return node(); }
+    static DiscardNode* appendSwitchCase(DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* appendSwitchStatement(DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* appendSwitchDefault(DiscardNode*) { return node(); }
+    static bool isName(DiscardNode*) { return true; }
+    static DiscardNode* makeBreak(std::string_view) { return node(); }
+    static DiscardNode* makeContinue(std::string_view) { return node(); }
+    static DiscardNode* makeReturn(DiscardNode*) { return node(); }
+    static DiscardNode* makeThrow(DiscardNode*) { return node(); }
+    static DiscardNode* makeTry(DiscardNode*, DiscardNode*, DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeVars() { return node(); }
+    static void appendVar(DiscardNode*, std::string_view, DiscardNode*) {}
+    static DiscardNode* makeLabel(std::string_view, DiscardNode*) { return node(); }
+    static DiscardNode* makeSub(DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeIndex(DiscardNode*, std::string_view) { return node(); }
+    static DiscardNode* makeConditional(DiscardNode*, DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeBinary(OpId, DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeUnary(OpId, DiscardNode*) { return node(); }
+    static DiscardNode* makeArray(DiscardNode*) { return node(); }
+    static DiscardNode* makeNew(DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeCall(DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeFunction(std::string_view, DiscardNode*, DiscardNode*) { return node(); }
+    static DiscardNode* makeName(std::string_view) { return node(); }
+    static DiscardNode* makeNum(double) { return node(); }
+    static DiscardNode* makeString(StringLiteral) { return node(); }
+    static DiscardNode* makeBool(bool) { return node(); }
+};
 
-        // Parse the base expression
-        auto op = findOperator(t->stringVal, 1, 'r');
-        auto baseExpr = parseExpr(input, op->prec);
+/**
+Push-style parser, which accepts the input in successive chunks and
+delivers each top-level statement to the Builder as soon as it is known
+to be complete. Only the source of the statements not yet complete is
+kept in memory.
+
+A statement is complete once it parses without the lexer reaching the end
+of the input received so far, so that no token it depends on can still be
+extended by the next chunk. Statements are first parsed with a
+DiscardBuilder to find the complete ones, and only those are parsed again
+with the Builder, so the Builder sees each statement once. An incomplete
+statement is parsed again from its start once the input buffered for it
+has doubled in size, which keeps the total work within a constant factor
+of a single parse.
+*/
+template<class ASTNode, class Builder>
+struct IncrementalParser
+{
+    Parser<ASTNode, Builder> parser;
 
-        // Parse the argument list (if present, otherwise assumed empty)
-        auto argExprs = input.peekSep("(") ? parseExprList(input, "(", ")") : nullptr;
+    /// Parser finding the end of the complete statements
+    Parser<DiscardNode, DiscardBuilder> scanner;
 
-        // Create the new expression
-        return Builder::makeNew(baseExpr, argExprs);
-    }
+    std::string fileName;
+    bool isRuntime;
 
-    // Function expression
-    // function (params) body
-    else if (input.matchKw("function"))
-    {
-        auto nextTok = input.peek();
+    /// Program node the statements are appended to
+    ASTNode* program;
 
-        auto params = parseParamList(input);
+    /// Buffered input. The source not yet parsed starts at windowStart,
+    /// and is followed by INPUT_PADDING zero bytes. The parsed source
+    /// before it is only erased once it fills half the buffer.
+    std::vector<char> window;
+    size_t windowStart;
+    size_t windowLen;
 
-        auto bodyStmt = parseStmt(input);
+    /// Incomplete UTF-8 sequence at the end of the last chunk, held back
+    /// until the next chunk completes it
+    char utf8Tail[4];
+    size_t utf8TailLen;
 
-        return Builder::makeFunction(nextTok->stringVal, params, bodyStmt);
-    }
+    /// Window length after the last parse
+    size_t parsedLen;
 
-    // Identifier/symbol literal
-    else if (t->type == Token::IDENT)
-    {
-        input.read();
-        return Builder::makeName(t->stringVal);
-    }
+    /// Source offset, line and column offsets of the window start in
+    /// the input
+    SrcOfs windowOfs;
+    SrcOfs windowLine;
+    SrcOfs windowCol;
 
-    // Integer literal
-    else if (t->type == Token::INT)
-    {
-        input.read();
-        return Builder::makeNum(t->intVal);
-    }
+    /// Lexer flags for the first token of the window
+    LexFlags windowFlags;
 
-    // Floating-point literal
-    else if (t->type == Token::FLOAT)
+    IncrementalParser(std::string fileName_ = "", bool isRuntime_ = false) : fileName(fileName_), isRuntime(isRuntime_), window(INPUT_PADDING, 0), windowStart(0), windowLen(0), utf8TailLen(0), parsedLen(0), windowOfs(0), windowLine(0), windowCol(0), windowFlags(LEX_MAYBE_RE)
     {
-        input.read();
-        return Builder::makeNum(t->floatVal);
+        program = Builder::makeToplevel();
     }
 
-    // String literal
-    else if (t->type == Token::STRING)
+    /**
+    Add a chunk of input. Complete top-level statements are appended to
+    the program. Returns false if the input received so far cannot be the
+    start of a valid program, the error is then recorded in parser.error
+    and further input is ignored.
+    */
+    bool feed(const char* data, size_t len)
     {
-        input.read();
-        return Builder::makeString(t->stringVal);
-    }
+        if (parser.failed())
+            return false;
 
-    // True boolean constant
-    else if (input.matchKw("true"))
-    {
-        return Builder::makeBool(true);
-    }
+        window.resize(windowStart + windowLen);
+        window.insert(window.end(), utf8Tail, utf8Tail + utf8TailLen);
+        window.insert(window.end(), data, data + len);
 
-    // False boolean constant
-    else if (input.matchKw("false"))
-    {
-        return Builder::makeBool(false);
+        // Hold back an incomplete UTF-8 sequence at the end
+        size_t end = window.size();
+        utf8TailLen = 0;
+        for (size_t i = 1; i <= 3 && i <= end - windowStart; ++i)
+        {
+            uint8_t ch = window[end - i];
+            if (ch < 0x80)
+                break;
+
+            if (ch >= 0xC0)
+            {
+                size_t seqLen = (ch >= 0xF0)? 4:(ch >= 0xE0)? 3:2;
+                if (seqLen > i)
+                    utf8TailLen = i;
+                break;
+            }
+        }
+
+        memcpy(utf8Tail, window.data() + end - utf8TailLen, utf8TailLen);
+        windowLen = end - utf8TailLen - windowStart;
+        window.resize(windowStart + windowLen);
+        window.resize(windowStart + windowLen + INPUT_PADDING, 0);
+
+        if (windowLen >= 2 * parsedLen)
+            parseWindow(false);
+
+        return !parser.failed();
     }
 
-    // Null constant
-    else if (input.matchKw("null"))
+    /**
+    Parse the rest of the input and get the program node. Returns null
+    on a parse error.
+    */
+    ASTNode* finish()
     {
-        return Builder::makeNull();
+        if (parser.failed())
+            return nullptr;
+
+        // An incomplete UTF-8 sequence at the end of the input is invalid
+        window.resize(windowStart + windowLen);
+        window.insert(window.end(), utf8Tail, utf8Tail + utf8TailLen);
+        windowLen = window.size() - windowStart;
+        utf8TailLen = 0;
+        window.resize(windowStart + windowLen + INPUT_PADDING, 0);
+
+        parseWindow(true);
+
+        return parser.failed()? nullptr:program;
     }
 
-    // Unary expressions
-    else if (t->type == Token::OP)
+    /**
+    Parse the complete statements of the window, then drop their source.
+    At the end of the input, all the remaining statements are complete.
+    */
+    void parseWindow(bool final)
     {
-        auto op = findOperator(t->stringVal, 1, 'r');
-        if (!op)
+        const char* src = window.data() + windowStart;
+        StrStream strStream(src, windowLen, fileName);
+
+        if (!strStream.validUtf8)
         {
-            throw new ParseError(
-                "invalid unary operator \"" + t->stringVal + "\"", 
-                pos
-            );
+            bool ascii;
+            const char* bad = findInvalidUtf8(strStream.str, strStream.str + strStream.strLen, ascii);
+            parser.fail(ERR_INVALID_UTF8, bad - strStream.str);
+            relocate();
+            return;
         }
 
-        // Consume the operator
-        input.read();
+        // Count the complete statements, without building them
+        SrcOfs start = strStream.index;
+        size_t numStmts = 0;
+        scanner.error = ParseError();
 
-        // Parse the right subexpression
-        ASTNode* expr = parseExpr(input, op->prec);
+        if (!final)
+        {
+            TokenStream scan(&strStream, windowFlags);
 
-        // Return the unary expression
-        return Builder::makeUnary(op->str, expr);
-    }
+            for (;;)
+            {
+                if (scan.eof() || strStream.reachedEnd)
+                    break;
 
-    throw new ParseError("unexpected token: " + t->toString(), pos);
-}
+                scanner.parseStmt(scan);
 
-/**
-Parse a list of expressions
-*/
-ASTNode* parseExprList(TokenStream& input, std::string openSep, std::string closeSep)
-{
-    readSep(input, openSep);
+                // The statement may be completed by the next chunk
+                if (strStream.reachedEnd)
+                {
+                    scanner.error = ParseError();
+                    break;
+                }
 
-    ASTNode* exprs = Builder::makeList();
+                if (scanner.failed())
+                    break;
 
-    for (;;)
-    {
-        if (input.matchSep(closeSep))
-            break;
+                numStmts++;
+            }
 
-        // If this is not the first element and there
-        // is no comma separator, throw an error
-        if (Builder::getSize(exprs) > 0 && input.matchSep(",") == false)
-            throw new ParseError("expected comma", input.getPos());
+            strStream.index = start;
+        }
 
-        // Handle missing array element syntax
-        if (openSep == "[")
-        {
-            if (input.matchSep(closeSep))
-                break;
+        // Build the complete statements
+        TokenStream input(&strStream, windowFlags);
 
-            if (input.peekSep(",")) 
+        for (size_t i = 0; final? !input.eof():(i < numStmts); ++i)
+        {
+            ASTNode* stmt = parser.parseStmt(input);
+            if (parser.failed())
             {
-                Builder::append(exprs, Builder::makeUndefined());
-                continue;
+                relocate();
+                return;
             }
-        }
 
-        // Parse the current element
-        Builder::append(exprs, parseExpr(input, COMMA_PREC+1));
-    }
-
-    return exprs;
-}
+            Builder::appendStatement(program, stmt);
+        }
 
-/**
-Parse a function declaration's parameter list
-*/
-ASTNode* parseParamList(TokenStream& input)
-{
-    readSep(input, "(");
+        // The error found when counting follows the complete statements
+        if (scanner.failed())
+        {
+            parser.error = scanner.error;
+            relocate();
+            return;
+        }
 
-    ASTNode* exprs = Builder::makeList();
+        drop(input.readEnd);
+        windowFlags = input.readFlags;
+        parsedLen = windowLen;
+    }
 
-    for (;;)
+    /**
+    Drop source from the start of the window
+    */
+    void drop(size_t len)
     {
-        if (input.matchSep(")"))
-            break;
+        const char* p = window.data() + windowStart;
+        const char* end = p + len;
+        const char* lineStart = nullptr;
+        for (; (p = (const char*)memchr(p, '\n', end - p)) != nullptr; lineStart = ++p)
+            windowLine++;
 
-        if (Builder::getSize(exprs) > 0 && input.matchSep(",") == false)
-            throw new ParseError("expected comma", input.getPos());
+        windowCol = lineStart? (end - lineStart):(windowCol + len);
 
-        auto expr = parseAtom(input);
-        if (!Builder::isName(expr))
-            throw new ParseError("invalid parameter", input.getPos());
+        windowStart += len;
+        windowLen -= len;
+        windowOfs += len;
 
-        Builder::append(exprs, expr);
+        // Erase the dropped source once it fills half the buffer, so that
+        // each byte is moved at most once on average
+        if (windowStart > window.size() / 2)
+        {
+            window.erase(window.begin(), window.begin() + windowStart);
+            windowStart = 0;
+        }
     }
 
-    return exprs;
-}
+    /**
+    Make the position of the error in the window relative to the input.
+    The source of the window is dropped later on, so the error is located
+    right away.
+    */
+    void relocate()
+    {
+        ParseError& e = parser.error;
+        e.locate(window.data() + windowStart);
 
-}; // struct Parser
+        if (e.line == 1)
+            e.col += windowCol;
+        e.line += windowLine;
+        e.ofs += windowOfs;
+    }
+};
 
 } // namespace almond
-
@@ -0,0 +1,967 @@
+/*****************************************************************************
+*
+*                      Higgs JavaScript Virtual Machine
+*
+*  This file is part of the Higgs project. The project is distributed at:
+*  https://github.com/maximecb/Higgs
+*
+*  Copyright (c) 2011-2014, Maxime Chevalier-Boisvert. All rights reserved.
+*
+*  This software is licensed under the following license (Modified BSD
+*  License):
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions are
+*  met:
+*   1. Redistributions of source code must retain the above copyright
+*      notice, this list of conditions and the following disclaimer.
+*   2. Redistributions in binary form must reproduce the above copyright
+*      notice, this list of conditions and the following disclaimer in the
+*      documentation and/or other materials provided with the distribution.
+*   3. The name of the author may not be used to endorse or promote
+*      products derived from this software without specific prior written
+*      permission.
+*
+*  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+*  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+*  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN
+*  NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+*  NOT LIMITED TO PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+*  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+// Scanning kernels used by the lexer to skip over whitespace, comments,
+// string bodies and other runs of uninteresting characters many bytes at
+// a time, and to validate the UTF-8 encoding of the input.
+//
+// Each kernel has a scalar version, and SSE2, SSSE3 and AVX2 versions.
+// The input must be followed by INPUT_PADDING zero bytes. The scanning
+// kernels read whole vectors into the padding and stop at the first NUL
+// byte, so they never compare against the end of the input. Callers tell
+// the end of the input from a NUL character by its offset. The scalar
+// versions read no further than the first NUL byte, and are used for
+// NUL-terminated inputs without padding.
+//
+// With GCC and Clang on x86, all versions are compiled with per-function
+// target attributes, and init() picks the best one for the host CPU. The
+// choice can be forced with the ALMOND_SIMD environment variable (scalar,
+// sse2, ssse3 or avx2) or with setSimdLevel(). Other compilers and targets
+// only get the versions enabled by the compiler flags.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALMOND_SIMD_DISPATCH 1
+#endif
+
+#if defined(ALMOND_SIMD_DISPATCH)
+#define ALMOND_SSE2 1
+#define ALMOND_SSSE3 1
+#define ALMOND_AVX2 1
+#define ALMOND_TARGET(isa) __attribute__((target(isa)))
+#else
+#if defined(__SSE2__)
+#define ALMOND_SSE2 1
+#endif
+#if defined(__SSSE3__)
+#define ALMOND_SSSE3 1
+#endif
+#if defined(__AVX2__)
+#define ALMOND_AVX2 1
+#endif
+#define ALMOND_TARGET(isa)
+#endif
+
+#if defined(ALMOND_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(ALMOND_SSSE3)
+#include <tmmintrin.h>
+#endif
+#if defined(ALMOND_AVX2)
+#include <immintrin.h>
+#endif
+
+namespace almond {
+
+/**
+Number of zero bytes which must follow the end of the input, enough for
+the widest vector load starting at the end of the input plus one
+*/
+const size_t INPUT_PADDING = 64;
+
+/**
+Skip whitespace characters (space, tab, CR, LF). Returns a pointer to the
+first non-whitespace character. Sets newline if a line feed was skipped.
+*/
+const char* skipSpaceScalar(const char* p, bool& newline)
+{
+    for (;; ++p)
+    {
+        char ch = *p;
+        if (ch == '\n')
+            newline = true;
+        else if (ch != ' ' && ch != '\t' && ch != '\r')
+            return p;
+    }
+}
+
+/**
+Find the end of a multi-line comment. Returns a pointer to the "*" of the
+closing "*\/", or to the first NUL byte. Sets newline if a line feed
+occurs before it.
+*/
+const char* findCommentEndScalar(const char* p, bool& newline)
+{
+    for (;; ++p)
+    {
+        if (p[0] == '*' && p[1] == '/')
+            return p;
+        if (p[0] == '\n')
+            newline = true;
+        else if (p[0] == '\0')
+            return p;
+    }
+}
+
+/**
+Find the next line feed or NUL byte
+*/
+const char* findNewlineScalar(const char* p)
+{
+    while (*p != '\n' && *p != '\0')
+        ++p;
+
+    return p;
+}
+
+/**
+Find the next character in a string or regexp body which needs attention:
+the closing quote character, a backslash, a line feed or a NUL byte
+*/
+const char* findQuoteScalar(const char* p, char quote)
+{
+    for (;; ++p)
+    {
+        char ch = *p;
+        if (ch == quote || ch == '\\' || ch == '\n' || ch == '\0')
+            return p;
+    }
+}
+
+/**
+Get the length of the UTF-8 sequence starting with a non-ASCII byte, or
+0 if the sequence is malformed or truncated by the end of the input.
+Overlong forms, surrogates and code points above 0x10FFFF are malformed.
+*/
+size_t utf8SeqLength(const char* p, const char* end)
+{
+    const uint8_t* s = (const uint8_t*)p;
+    size_t left = end - p;
+    auto cont = [s, left](size_t i) { return i < left && (s[i] & 0xC0) == 0x80; };
+
+    if (s[0] >= 0xC2 && s[0] <= 0xDF)
+        return cont(1)? 2:0;
+
+    if (s[0] >= 0xE0 && s[0] <= 0xEF)
+    {
+        if (!cont(1) || !cont(2))
+            return 0;
+        if (s[0] == 0xE0 && s[1] < 0xA0)
+            return 0;
+        if (s[0] == 0xED && s[1] >= 0xA0)
+            return 0;
+        return 3;
+    }
+
+    if (s[0] >= 0xF0 && s[0] <= 0xF4)
+    {
+        if (!cont(1) || !cont(2) || !cont(3))
+            return 0;
+        if (s[0] == 0xF0 && s[1] < 0x90)
+            return 0;
+        if (s[0] == 0xF4 && s[1] >= 0x90)
+            return 0;
+        return 4;
+    }
+
+    return 0;
+}
+
+/**
+Find the first malformed UTF-8 sequence. Returns a pointer to it, or null
+if the input is valid. Clears ascii if a non-ASCII character is seen.
+*/
+const char* findInvalidUtf8(const char* p, const char* end, bool& ascii)
+{
+    while (p < end)
+    {
+        // Skip ASCII characters 8 bytes at a time
+        if (p + 8 <= end)
+        {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            if ((word & 0x8080808080808080ull) == 0)
+            {
+                p += 8;
+                continue;
+            }
+        }
+
+        if ((uint8_t)*p < 0x80)
+        {
+            ++p;
+            continue;
+        }
+
+        ascii = false;
+
+        size_t len = utf8SeqLength(p, end);
+        if (len == 0)
+            return p;
+        p += len;
+    }
+
+    return nullptr;
+}
+
+/**
+Validate the UTF-8 encoding of the input. Sets ascii if the input is pure
+ASCII.
+*/
+bool validateUtf8Scalar(const char* p, const char* end, bool& ascii)
+{
+    ascii = true;
+    return findInvalidUtf8(p, end, ascii) == nullptr;
+}
+
+/// Error bits of the UTF-8 lookup tables, each one is set by a pair of
+/// lookups on the previous byte and one on the current byte
+const uint8_t UTF8_TOO_SHORT = 1 << 0;
+const uint8_t UTF8_TOO_LONG = 1 << 1;
+const uint8_t UTF8_OVERLONG_3 = 1 << 2;
+const uint8_t UTF8_TOO_LARGE = 1 << 3;
+const uint8_t UTF8_SURROGATE = 1 << 4;
+const uint8_t UTF8_OVERLONG_2 = 1 << 5;
+const uint8_t UTF8_TOO_LARGE_1000 = 1 << 6;
+const uint8_t UTF8_OVERLONG_4 = 1 << 6;
+const uint8_t UTF8_TWO_CONTS = 1 << 7;
+const uint8_t UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS;
+
+/**
+Lookup tables of the vectorized UTF-8 validation algorithm of Keiser and
+Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte". They are
+indexed by the high nibble of the previous byte, the low nibble of the
+previous byte and the high nibble of the current byte, and the bitwise and
+of the three lookups is the set of errors for a pair of bytes.
+*/
+const uint8_t utf8Byte1High[16] = {
+    // 0_______ ________, ASCII followed by anything
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    // 10______ ________, continuation byte
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    // 1100____ ________, two byte lead
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    // 1101____ ________, two byte lead
+    UTF8_TOO_SHORT,
+    // 1110____ ________, three byte lead
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    // 1111____ ________, four byte lead
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+const uint8_t utf8Byte1Low[16] = {
+    // ____0000 ________
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    // ____0001 ________
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    // ____001_ ________
+    UTF8_CARRY,
+    UTF8_CARRY,
+    // ____0100 ________
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    // ____0101 ________ and above
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    // ____1101 ________
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+const uint8_t utf8Byte2High[16] = {
+    // ________ 0_______, lead byte followed by ASCII
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    // ________ 1000____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    // ________ 1001____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE,
+    // ________ 101_____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+    // ________ 11______, lead byte followed by a lead byte
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/// Largest values of the last three bytes of a block which do not
+/// start a sequence continuing into the next block
+const uint8_t utf8MaxTail[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+#if defined(ALMOND_SSE2)
+
+ALMOND_TARGET("sse2")
+const char* skipSpaceSSE2(const char* p, bool& newline)
+{
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    for (;; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i isLf = _mm_cmpeq_epi8(v, lf);
+        __m128i isWs = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), isLf)
+        );
+
+        unsigned wsMask = _mm_movemask_epi8(isWs);
+        unsigned lfMask = _mm_movemask_epi8(isLf);
+
+        if (wsMask != 0xFFFF)
+        {
+            unsigned n = __builtin_ctz(~wsMask);
+            if (lfMask & ((1u << n) - 1))
+                newline = true;
+            return p + n;
+        }
+
+        if (lfMask)
+            newline = true;
+    }
+}
+
+ALMOND_TARGET("sse2")
+const char* findCommentEndSSE2(const char* p, bool& newline)
+{
+    const __m128i star = _mm_set1_epi8('*');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+
+    for (;; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i next = _mm_loadu_si128((const __m128i*)(p + 1));
+
+        unsigned endMask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(v, star), _mm_cmpeq_epi8(next, slash)),
+            _mm_cmpeq_epi8(v, zero)
+        ));
+        unsigned lfMask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+        if (endMask)
+        {
+            unsigned n = __builtin_ctz(endMask);
+            if (lfMask & ((1u << n) - 1))
+                newline = true;
+            return p + n;
+        }
+
+        if (lfMask)
+            newline = true;
+    }
+}
+
+ALMOND_TARGET("sse2")
+const char* findNewlineSSE2(const char* p)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+
+    for (;; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, zero))
+        );
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+ALMOND_TARGET("sse2")
+const char* findQuoteSSE2(const char* p, char quote)
+{
+    const __m128i q = _mm_set1_epi8(quote);
+    const __m128i bs = _mm_set1_epi8('\\');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+
+    for (;; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, bs)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, zero))
+        );
+
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+/**
+Validate UTF-8, skipping ASCII 16 bytes at a time and checking non-ASCII
+characters one at a time
+*/
+ALMOND_TARGET("sse2")
+bool validateUtf8SSE2(const char* p, const char* end, bool& ascii)
+{
+    ascii = true;
+
+    while (p + 16 <= end)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned highMask = _mm_movemask_epi8(v);
+
+        if (highMask == 0)
+        {
+            p += 16;
+            continue;
+        }
+
+        ascii = false;
+        p += __builtin_ctz(highMask);
+
+        while (p < end && (uint8_t)*p >= 0x80)
+        {
+            size_t len = utf8SeqLength(p, end);
+            if (len == 0)
+                return false;
+            p += len;
+        }
+    }
+
+    return findInvalidUtf8(p, end, ascii) == nullptr;
+}
+
+#endif
+
+#if defined(ALMOND_SSSE3)
+
+/**
+Compute the UTF-8 error bits for a block, given the previous block
+*/
+ALMOND_TARGET("ssse3")
+__m128i utf8ErrorsSSSE3(__m128i input, __m128i prevInput)
+{
+    const __m128i lowNibble = _mm_set1_epi8(0x0F);
+    const __m128i byte1High = _mm_loadu_si128((const __m128i*)utf8Byte1High);
+    const __m128i byte1Low = _mm_loadu_si128((const __m128i*)utf8Byte1Low);
+    const __m128i byte2High = _mm_loadu_si128((const __m128i*)utf8Byte2High);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prevInput, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prevInput, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prevInput, 13);
+
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(byte1High, _mm_and_si128(_mm_srli_epi16(prev1, 4), lowNibble)),
+            _mm_shuffle_epi8(byte1Low, _mm_and_si128(prev1, lowNibble))
+        ),
+        _mm_shuffle_epi8(byte2High, _mm_and_si128(_mm_srli_epi16(input, 4), lowNibble))
+    );
+
+    // Third and fourth bytes of 3 and 4 byte sequences must be
+    // continuations, which the special cases above do not check
+    __m128i isThird = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+    __m128i isFourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(isThird, isFourth), _mm_set1_epi8((char)0x80));
+
+    return _mm_xor_si128(must23, special);
+}
+
+ALMOND_TARGET("ssse3")
+bool validateUtf8SSSE3(const char* p, const char* end, bool& ascii)
+{
+    const __m128i maxTail = _mm_loadu_si128((const __m128i*)(utf8MaxTail + 16));
+
+    __m128i error = _mm_setzero_si128();
+    __m128i prevInput = _mm_setzero_si128();
+    __m128i prevIncomplete = _mm_setzero_si128();
+    ascii = true;
+
+    for (;;)
+    {
+        __m128i input;
+
+        if (p + 16 <= end)
+        {
+            input = _mm_loadu_si128((const __m128i*)p);
+        }
+        else if (p < end)
+        {
+            // Pad the last block with zeros
+            char tail[16] = {};
+            memcpy(tail, p, end - p);
+            input = _mm_loadu_si128((const __m128i*)tail);
+        }
+        else
+        {
+            break;
+        }
+
+        if (_mm_movemask_epi8(input) == 0)
+        {
+            error = _mm_or_si128(error, prevIncomplete);
+        }
+        else
+        {
+            ascii = false;
+            error = _mm_or_si128(error, utf8ErrorsSSSE3(input, prevInput));
+            prevIncomplete = _mm_subs_epu8(input, maxTail);
+        }
+
+        prevInput = input;
+        p += 16;
+    }
+
+    error = _mm_or_si128(error, prevIncomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+#endif
+
+#if defined(ALMOND_AVX2)
+
+ALMOND_TARGET("avx2")
+const char* skipSpaceAVX2(const char* p, bool& newline)
+{
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    for (;; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i isLf = _mm256_cmpeq_epi8(v, lf);
+        __m256i isWs = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), isLf)
+        );
+
+        uint32_t wsMask = _mm256_movemask_epi8(isWs);
+        uint32_t lfMask = _mm256_movemask_epi8(isLf);
+
+        if (wsMask != 0xFFFFFFFF)
+        {
+            unsigned n = __builtin_ctz(~wsMask);
+            if (lfMask & ((1ull << n) - 1))
+                newline = true;
+            return p + n;
+        }
+
+        if (lfMask)
+            newline = true;
+    }
+}
+
+ALMOND_TARGET("avx2")
+const char* findCommentEndAVX2(const char* p, bool& newline)
+{
+    const __m256i star = _mm256_set1_epi8('*');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (;; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i next = _mm256_loadu_si256((const __m256i*)(p + 1));
+
+        uint32_t endMask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(v, star), _mm256_cmpeq_epi8(next, slash)),
+            _mm256_cmpeq_epi8(v, zero)
+        ));
+        uint32_t lfMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+
+        if (endMask)
+        {
+            unsigned n = __builtin_ctz(endMask);
+            if (lfMask & ((1ull << n) - 1))
+                newline = true;
+            return p + n;
+        }
+
+        if (lfMask)
+            newline = true;
+    }
+}
+
+ALMOND_TARGET("avx2")
+const char* findNewlineAVX2(const char* p)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (;; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        uint32_t mask = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, zero))
+        );
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+ALMOND_TARGET("avx2")
+const char* findQuoteAVX2(const char* p, char quote)
+{
+    const __m256i q = _mm256_set1_epi8(quote);
+    const __m256i bs = _mm256_set1_epi8('\\');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (;; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, q), _mm256_cmpeq_epi8(v, bs)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, zero))
+        );
+
+        uint32_t mask = _mm256_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+ALMOND_TARGET("avx2")
+__m256i utf8ErrorsAVX2(__m256i input, __m256i prevInput)
+{
+    const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte1High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8Byte1High));
+    const __m256i byte1Low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8Byte1Low));
+    const __m256i byte2High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8Byte2High));
+
+    // Previous bytes, across the 128-bit lanes
+    __m256i shifted = _mm256_permute2x128_si256(prevInput, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble)),
+            _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, lowNibble))
+        ),
+        _mm256_shuffle_epi8(byte2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble))
+    );
+
+    __m256i isThird = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i isFourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(isThird, isFourth), _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must23, special);
+}
+
+ALMOND_TARGET("avx2")
+bool validateUtf8AVX2(const char* p, const char* end, bool& ascii)
+{
+    const __m256i maxTail = _mm256_loadu_si256((const __m256i*)utf8MaxTail);
+
+    __m256i error = _mm256_setzero_si256();
+    __m256i prevInput = _mm256_setzero_si256();
+    __m256i prevIncomplete = _mm256_setzero_si256();
+    ascii = true;
+
+    for (;;)
+    {
+        __m256i input;
+
+        if (p + 32 <= end)
+        {
+            input = _mm256_loadu_si256((const __m256i*)p);
+        }
+        else if (p < end)
+        {
+            char tail[32] = {};
+            memcpy(tail, p, end - p);
+            input = _mm256_loadu_si256((const __m256i*)tail);
+        }
+        else
+        {
+            break;
+        }
+
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+            error = _mm256_or_si256(error, prevIncomplete);
+        }
+        else
+        {
+            ascii = false;
+            error = _mm256_or_si256(error, utf8ErrorsAVX2(input, prevInput));
+            prevIncomplete = _mm256_subs_epu8(input, maxTail);
+        }
+
+        prevInput = input;
+        p += 32;
+    }
+
+    error = _mm256_or_si256(error, prevIncomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+#endif
+
+/**
+Instruction set tiers of the scanning kernels, in increasing order
+*/
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_SSSE3,
+    SIMD_AVX2,
+
+    NUM_SIMD_LEVELS
+};
+
+/**
+Tier names, as accepted by the ALMOND_SIMD environment variable
+*/
+const char* simdLevelNames[NUM_SIMD_LEVELS] = {
+    "scalar",
+    "sse2",
+    "ssse3",
+    "avx2"
+};
+
+/**
+Kernel implementations in use, one function pointer per kernel
+*/
+struct SimdKernels
+{
+    SimdLevel level;
+    const char* (*skipSpace)(const char* p, bool& newline);
+    const char* (*findCommentEnd)(const char* p, bool& newline);
+    const char* (*findNewline)(const char* p);
+    const char* (*findQuote)(const char* p, char quote);
+    bool (*validateUtf8)(const char* p, const char* end, bool& ascii);
+};
+
+/**
+Get the kernels of a tier. Tiers without a version of some kernel use the
+next lower version.
+*/
+SimdKernels getSimdKernels(SimdLevel level)
+{
+    SimdKernels k = {
+        SIMD_SCALAR,
+        skipSpaceScalar,
+        findCommentEndScalar,
+        findNewlineScalar,
+        findQuoteScalar,
+        validateUtf8Scalar
+    };
+
+#if defined(ALMOND_SSE2)
+    if (level >= SIMD_SSE2)
+    {
+        k.level = SIMD_SSE2;
+        k.skipSpace = skipSpaceSSE2;
+        k.findCommentEnd = findCommentEndSSE2;
+        k.findNewline = findNewlineSSE2;
+        k.findQuote = findQuoteSSE2;
+        k.validateUtf8 = validateUtf8SSE2;
+    }
+#endif
+
+#if defined(ALMOND_SSSE3)
+    if (level >= SIMD_SSSE3)
+    {
+        k.level = SIMD_SSSE3;
+        k.validateUtf8 = validateUtf8SSSE3;
+    }
+#endif
+
+#if defined(ALMOND_AVX2)
+    if (level >= SIMD_AVX2)
+    {
+        k.level = SIMD_AVX2;
+        k.skipSpace = skipSpaceAVX2;
+        k.findCommentEnd = findCommentEndAVX2;
+        k.findNewline = findNewlineAVX2;
+        k.findQuote = findQuoteAVX2;
+        k.validateUtf8 = validateUtf8AVX2;
+    }
+#endif
+
+    return k;
+}
+
+/**
+Get the highest tier the compiler flags guarantee, used until
+initSimd() is called
+*/
+constexpr SimdLevel baselineSimdLevel()
+{
+#if defined(__AVX2__)
+    return SIMD_AVX2;
+#elif defined(__SSSE3__)
+    return SIMD_SSSE3;
+#elif defined(__SSE2__)
+    return SIMD_SSE2;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+/**
+Kernels used by the lexer
+*/
+SimdKernels simdKernels = getSimdKernels(baselineSimdLevel());
+
+/**
+Scalar kernels, which read no further than the first NUL byte. Used for
+inputs which are not followed by padding.
+*/
+const SimdKernels scalarKernels = getSimdKernels(SIMD_SCALAR);
+
+/**
+Get the highest tier supported by the host CPU
+*/
+SimdLevel detectSimdLevel()
+{
+#if defined(ALMOND_SIMD_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return SIMD_SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+    return SIMD_SCALAR;
+#else
+    return baselineSimdLevel();
+#endif
+}
+
+/**
+Force the kernels of a tier, for benchmarking and debugging. Returns
+false and leaves the kernels unchanged if the host CPU does not support
+the tier.
+*/
+bool setSimdLevel(SimdLevel level)
+{
+    if (level < SIMD_SCALAR || level > detectSimdLevel())
+        return false;
+
+    simdKernels = getSimdKernels(level);
+    return true;
+}
+
+/**
+Get the tier of the kernels in use
+*/
+SimdLevel getSimdLevel()
+{
+    return simdKernels.level;
+}
+
+/**
+Select the kernels for the host CPU, or the tier named by the ALMOND_SIMD
+environment variable if it is set. Called by init().
+*/
+void initSimd()
+{
+    SimdLevel level = detectSimdLevel();
+
+    if (const char* name = getenv("ALMOND_SIMD"))
+    {
+        for (int i = 0; i < NUM_SIMD_LEVELS; ++i)
+        {
+            if (strcmp(name, simdLevelNames[i]) == 0 && i <= level)
+            {
+                level = (SimdLevel)i;
+                break;
+            }
+        }
+    }
+
+    simdKernels = getSimdKernels(level);
+}
+
+/**
+Skip whitespace using the selected kernel
+*/
+const char* skipSpace(const char* p, bool& newline)
+{
+    return simdKernels.skipSpace(p, newline);
+}
+
+/**
+Find the end of a multi-line comment using the selected kernel
+*/
+const char* findCommentEnd(const char* p, bool& newline)
+{
+    return simdKernels.findCommentEnd(p, newline);
+}
+
+/**
+Find the next line feed or NUL byte using the selected kernel
+*/
+const char* findNewline(const char* p)
+{
+    return simdKernels.findNewline(p);
+}
+
+/**
+Find the next quote, backslash, line feed or NUL byte using the selected
+kernel
+*/
+const char* findQuote(const char* p, char quote)
+{
+    return simdKernels.findQuote(p, quote);
+}
+
+/**
+Validate UTF-8 using the selected kernel
+*/
+bool validateUtf8(const char* p, const char* end, bool& ascii)
+{
+    return simdKernels.validateUtf8(p, end, ascii);
+}
+
+} // namespace almond
@@ -1,6 +1,9 @@
 #include "lexer.h"
 #include "parser.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 struct TestNode {};
 
 struct TestBuilder {
@@ -166,9 +169,167 @@ struct TestBuilder {
 
 almond::Parser<TestNode, TestBuilder> tb;
 
+// Lex a statement past 4 GB into a sparse file of NUL characters. Only
+// run when ALMOND_TEST_LARGE is set, as not every filesystem supports
+// sparse files. The file is created in $TMPDIR.
+void testLargeInput() {
+  if (!getenv("ALMOND_TEST_LARGE")) return;
+
+  const char* tmpDir = getenv("TMPDIR");
+  std::string pathStr = std::string(tmpDir && *tmpDir ? tmpDir : "/tmp") + "/almond_large_test.js";
+  const char* path = pathStr.c_str();
+  const char stmt[] = "\n  foo = 1;";
+  size_t stmtLen = sizeof(stmt) - 1;
+  size_t size = (4ull << 30) + stmtLen;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0 ||
+      pwrite(fd, stmt, stmtLen, size - stmtLen) != (ssize_t)stmtLen) {
+    printf("cannot create %s\n", path);
+    return;
+  }
+
+  close(fd);
+
+  almond::MappedFile mapping;
+  bool mapped = mapping.open(path);
+  unlink(path);
+  if (!mapped) {
+    printf("cannot map %s\n", path);
+    return;
+  }
+
+  almond::StrStream stream(mapping, path);
+  stream.skip(size - stmtLen);
+  almond::Token t = almond::getToken(stream, 0);
+  almond::SrcPos pos = stream.getPos(t.ofs);
+  printf("%s at %llu, line %llu col %llu\n",
+    stream.symbols.name(t.atom).c_str(), (unsigned long long)t.ofs,
+    (unsigned long long)pos.line, (unsigned long long)pos.col);
+  pos = stream.getPos(size - stmtLen);
+  printf("line %llu col %llu\n", (unsigned long long)pos.line, (unsigned long long)pos.col);
+}
+
 int main() {
   almond::init();
 
   tb.parseFile("test.js", "print('hello world');");
-}
 
+  const char fileSrc[] = "#!/usr/bin/env node\nprint(42);\n";
+  FILE* file = fopen("almond_test.js", "wb");
+  fwrite(fileSrc, 1, sizeof(fileSrc) - 1, file);
+  fclose(file);
+  tb.parseFile("almond_test.js");
+  unlink("almond_test.js");
+
+  char src[] = "print('hello world');";
+  almond::StrStream stream(src, "test.js");
+  almond::TokenArray tokens;
+  tokens.lex(stream);
+  tb.parseTokens(stream, tokens);
+
+  // Explicit length, with a NUL character in a string literal
+  const char nulStr[] = "var s = 'a\0b';";
+  almond::PaddedBuffer nulSrc(nulStr, sizeof(nulStr) - 1);
+  tb.parseString(nulSrc.str(), nulSrc.len, "nul.js");
+
+  // String literal escapes, decoded only when the value is requested
+  std::string decoded = almond::decodeString("a\\tb\\x41\\u00e9\\u{1F600}\\\n\\101");
+  for (unsigned char c : decoded) printf("%02x ", c);
+  printf("\n");
+
+  // Hex and legacy octal literals too large for an integer token
+  std::string bigNums[] = {
+    "0x1fffffffffffffff", "0x" + std::string(300, 'f'),
+    "01" + std::string(29, '0') + "1", "0" + std::string(500, '7')
+  };
+  for (const std::string& num : bigNums) {
+    almond::PaddedBuffer numBuf(num.data(), num.size());
+    almond::StrStream numStream(numBuf.str(), numBuf.len, "num.js");
+    printf("%.17g ", almond::readNumber(numStream).floatVal);
+  }
+  printf("\n");
+
+  // Line continuation with a CRLF line break
+  tb.parseString("var s = 'a\\\r\nb';");
+
+  // NUL-terminated input is lexed in place, up to its terminator
+  tb.parseString("var s = 'a\\");
+  printf("%s\n", tb.error.toString().c_str());
+
+  // Chunks splitting a UTF-8 sequence, a string and an if statement
+  almond::IncrementalParser<TestNode, TestBuilder> ip("chunks.js");
+  const char* chunks[] = {
+    "var \xcf", "\x80 = 'a", "b';\nif (x) y", ";\nelse z;\nfoo(", "1)"
+  };
+  for (const char* chunk : chunks) {
+    printf("feed\n");
+    ip.feed(chunk, strlen(chunk));
+  }
+  printf("finish\n");
+  ip.finish();
+
+  // Input fed one byte at a time parses as it does in one string
+  const char* chunkedSrcs[] = { "#!/x\na;", "a;\nb = 'c'" };
+  for (const char* chunkedSrc : chunkedSrcs) {
+    almond::IncrementalParser<TestNode, TestBuilder> bp;
+    for (const char* p = chunkedSrc; *p; ++p)
+      bp.feed(p, 1);
+    bp.finish();
+    tb.parseString(chunkedSrc);
+    bool same = bp.parser.error.id == tb.error.id && bp.parser.error.ofs == tb.error.ofs;
+    printf("%s\n", same ? "same result" : "different result");
+  }
+
+  // Loop heads and labels are parsed once, without throwaway nodes
+  tb.parseString("for (var k in o) f(k);\nfor (i = 0, j = 1; i < n; i++);\nfor (k in o);\nouter: for (;;) break outer;");
+
+  // Expression operators are looked up by token ID, in agreement with
+  // the operator table
+  for (int id = 1; id < almond::NUM_OP_IDS; ++id) {
+    const almond::OpRule& rule = almond::opRules[id];
+    auto infixOp = almond::findOperator(almond::opStrings[id], 2);
+    if (!infixOp) infixOp = almond::findOperator(almond::opStrings[id], 1, 'l');
+    if (!infixOp) infixOp = almond::findOperator(almond::opStrings[id], 3);
+    auto prefixOp = almond::findOperator(almond::opStrings[id], 1, 'r');
+    bool infixOk = infixOp ? (rule.infix != almond::INFIX_NONE && rule.prec == infixOp->prec &&
+      rule.rightAssoc == (infixOp->assoc == 'r')) : (rule.infix == almond::INFIX_NONE);
+    bool prefixOk = prefixOp ? (rule.prefixPrec == prefixOp->prec) : (rule.prefixPrec < 0);
+    if (!infixOk || !prefixOk) printf("operator rule mismatch: %s\n", almond::opStrings[id]);
+  }
+  tb.parseString("a += b * c - d ? e : f, g.h[i](j)++, -new X(1) in y;");
+
+  // Nested statements and expressions are parsed with an explicit stack
+  tb.parseString("if (a) b = c ? d : e ? f : g; else if (h) do { i(j)(k); } while (l); else m: n;");
+
+  // Try statement clauses are recognized by their keywords
+  const char* trySrcs[] = {
+    "try { a } catch (e) { b } finally { c }", "try { a } finally { c }", "try { a }", "try { a } catch (1) { b }"
+  };
+  for (const char* trySrc : trySrcs) {
+    tb.parseString(trySrc);
+    printf("%s\n", tb.error.toString().c_str());
+  }
+
+  char unicodeSrc[] = "var \u03c0\u00e9 = 3, \u0434\u0430\u0301\u043d\u043d\u044b\u0435;";
+  tb.parseString(unicodeSrc);
+
+  char badSrc[] = "var s = '\xc3\x28';";
+  for (int i = 0; i < almond::NUM_SIMD_LEVELS; ++i) {
+    if (!almond::setSimdLevel((almond::SimdLevel)i)) break;
+    printf("%s\n", almond::simdLevelNames[i]);
+    tb.parseString(badSrc);
+    if (tb.failed()) {
+      printf("%s\n", tb.error.toString().c_str());
+    }
+  }
+
+  // Errors are recorded without unwinding, and located on request
+  char errSrc[] = "var a = 1;\nvar 5;";
+  tb.parseString(errSrc);
+  tb.error.locate(errSrc);
+  printf("%s at line %llu col %llu\n", tb.error.toString().c_str(),
+    (unsigned long long)tb.error.line, (unsigned long long)tb.error.col);
+
+  testLargeInput();
+}